@@ -0,0 +1,128 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <remote_memory.h>
+#include <string_table.h>
+
+namespace spiritsaway::cpy_frame
+{
+	// One row of a decoded co_lnotab: instructions from addr onwards up to the next
+	// row belong to line.
+	struct line_entry
+	{
+		int addr;
+		int line;
+	};
+
+	// The immutable parts of a remote PyCodeObject, read and decoded once.
+	struct code_info
+	{
+		// remote co_filename pointer, compared on every lookup to detect a code
+		// object that was freed and whose address got reused
+		void* co_filename;
+		// ids of co_filename and co_name in the StringTable of the owning CodeCache
+		std::uint32_t file_id;
+		std::uint32_t name_id;
+		int firstlineno;
+		// co_lnotab decoded into rows sorted by addr, the first one is
+		// (0, firstlineno)
+		std::vector<line_entry> lines;
+
+		// Decode a raw co_lnotab into lines.
+		void SetLineTable(const uint8_t* lnotab, std::size_t size);
+
+		// Line number of the instruction at f_lasti by binary search, see
+		// PyCode_Addr2Line.
+		std::size_t Line(int f_lasti) const;
+	};
+
+	// The words of a remote PyCodeObject every lookup is validated with.
+	struct code_header
+	{
+		void* ob_type;
+		void* co_filename;
+
+		// Two chunks reading the header of the code object at f_code.
+		static void Chunks(void* f_code, code_header& header, remote_chunk* chunks);
+	};
+
+	// Code objects keyed by their remote address. Meant to be kept across samples
+	// of the same process, entries are validated on every lookup and the least
+	// recently used ones are evicted once capacity is reached.
+	class CodeCache
+	{
+	public:
+		// code_type_addr and string_type_addr are the remote PyCode_Type and
+		// PyString_Type, 0 skips the matching ob_type check
+		explicit CodeCache(void* code_type_addr, void* string_type_addr = nullptr, std::size_t capacity = 4096);
+
+		// Returns nullptr if f_code is not a code object, a code object with a
+		// garbage co_lnotab fails with EINVAL. The returned pointer is
+		// valid until the next call to Get.
+		const code_info* Get(RemoteMemory& mem, void* f_code);
+
+		// Non-throwing form of the above, for walks where a failed read is
+		// routine. A code object is not cached if reading any part of it failed.
+		read_result<const code_info*> TryGet(RemoteMemory& mem, void* f_code);
+		// Same as above for a caller that already read the header of f_code, e.g.
+		// batched with other reads. The rest of the code object is only read on
+		// a miss.
+		read_result<const code_info*> TryGet(RemoteMemory& mem, void* f_code, const code_header& header);
+
+		void Clear();
+		// Clear and check code objects against new types, after the target exec'd.
+		void Retarget(void* code_type_addr, void* string_type_addr);
+
+		// Table holding the file and name of every cached code object, entries
+		// survive Clear and eviction so that ids handed out stay valid.
+		inline StringTable& strings()
+		{
+			return strings_;
+		}
+
+		inline const StringTable& strings() const
+		{
+			return strings_;
+		}
+
+		inline std::size_t size() const
+		{
+			return index_.size();
+		}
+
+		inline std::size_t hits() const
+		{
+			return hits_;
+		}
+
+		inline std::size_t misses() const
+		{
+			return misses_;
+		}
+
+		inline std::size_t evictions() const
+		{
+			return evictions_;
+		}
+
+	private:
+		using lru_list = std::list<std::pair<void*, code_info>>;
+
+		void* code_type_addr_;
+		void* string_type_addr_;
+		std::size_t capacity_;
+		lru_list entries_;  // most recently used first
+		std::unordered_map<void*, lru_list::iterator> index_;
+		std::size_t hits_;
+		std::size_t misses_;
+		std::size_t evictions_;
+		StringTable strings_;
+
+		read_result<code_info> Load(RemoteMemory& mem, const void* snapshot);
+	};
+}
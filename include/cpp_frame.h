@@ -0,0 +1,97 @@
+#pragma once
+#include <sys/types.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include <elf_utils.h>
+#include <memory_map.h>
+#include <posix_file_util.h>
+#include <string_table.h>
+
+namespace spiritsaway::cpy_frame
+{
+	struct native_frame
+	{
+		void* ip;
+		// empty if no mapping contains ip
+		std::string_view module;
+		// demangled, empty if the module has no symbol for ip
+		std::string_view name;
+		// from the symbol, or from the start of the module without one
+		std::size_t offset;
+		friend std::ostream& operator<<(std::ostream& os, const native_frame& frame)
+		{
+			os << frame.ip;
+			if (!frame.name.empty())
+			{
+				os << " " << frame.name << "+0x" << std::hex << frame.offset << std::dec;
+			}
+			else if (!frame.module.empty())
+			{
+				os << " " << frame.module << "+0x" << std::hex << frame.offset << std::dec;
+			}
+			return os;
+		}
+	};
+
+	// Resolves instruction pointers of a remote process to native symbols. The
+	// executable file mappings of the MemoryMap are kept sorted by address, a
+	// module's ELF is opened and its address index built on the first address
+	// that falls into it, and demangled names are cached, so a repeated lookup is
+	// two binary searches. The strings in a native_frame are interned and stay
+	// valid as long as the symbolizer, Refresh included.
+	class NativeSymbolizer
+	{
+	public:
+		explicit NativeSymbolizer(pid_t pid);
+		~NativeSymbolizer();
+		NativeSymbolizer(const NativeSymbolizer& other) = delete;
+		NativeSymbolizer& operator=(const NativeSymbolizer& other) = delete;
+
+		native_frame Symbolize(void* ip);
+
+		// Re-read the mappings after the target loaded or unloaded libraries.
+		// Modules mapped at the same place keep their index.
+		void Refresh();
+
+		inline std::size_t modules() const
+		{
+			return modules_.size();
+		}
+
+	private:
+		struct module
+		{
+			std::uintptr_t start;
+			std::uintptr_t end;
+			std::size_t offset;
+			std::string path;
+			// path in names_
+			std::uint32_t path_id;
+			std::shared_ptr<ELF> elf;
+			bool loaded;
+		};
+
+		pid_t pid_;
+		std::unique_ptr<Namespace> ns_;
+		MemoryMap maps_;
+		// executable file mappings, sorted by start
+		std::vector<module> modules_;
+		// module paths and demangled names handed out in native_frames, never
+		// dropped
+		StringTable names_;
+		// ids in names_ keyed by the mangled name, which points into a mapped
+		// string table
+		std::unordered_map<const char*, std::uint32_t> demangled_;
+
+		ELF* Load(module& one_module);
+		std::string_view Demangle(const char* name);
+	};
+}
@@ -3,9 +3,11 @@
 #include <elf.h>
 
 #include <limits.h>
+#include <memory>
 #include <sstream>
 #include <stdexcept>
 #include <string>
+#include <utility>
 #include <vector>
 
 #include <custom_exceptions.h>
@@ -47,6 +49,10 @@ namespace spiritsaway::cpy_frame
         void* interp_head_addr;
         void* interp_head_fn_addr;
         void* interp_head_hint;
+        // type objects used to sanity check remote objects, may be 0
+        void* frame_type_addr;
+        void* code_type_addr;
+        void* string_type_addr;
         bool pie;
 
         PyAddresses()
@@ -54,6 +60,9 @@ namespace spiritsaway::cpy_frame
             interp_head_addr(0),
             interp_head_fn_addr(0),
             interp_head_hint(0),
+            frame_type_addr(0),
+            code_type_addr(0),
+            string_type_addr(0),
             pie(false)
         {
         }
@@ -66,6 +75,12 @@ namespace spiritsaway::cpy_frame
                 this->interp_head_addr == 0 ? 0 : this->interp_head_addr - base;
             res.interp_head_fn_addr =
                 this->interp_head_fn_addr == 0 ? 0 : this->interp_head_fn_addr - base;
+            res.frame_type_addr =
+                this->frame_type_addr == 0 ? 0 : this->frame_type_addr - base;
+            res.code_type_addr =
+                this->code_type_addr == 0 ? 0 : this->code_type_addr - base;
+            res.string_type_addr =
+                this->string_type_addr == 0 ? 0 : this->string_type_addr - base;
             return res;
         }
 
@@ -77,6 +92,12 @@ namespace spiritsaway::cpy_frame
                 this->interp_head_addr == 0 ? 0 : this->interp_head_addr + base;
             res.interp_head_fn_addr =
                 this->interp_head_fn_addr == 0 ? 0 : this->interp_head_fn_addr + base;
+            res.frame_type_addr =
+                this->frame_type_addr == 0 ? 0 : this->frame_type_addr + base;
+            res.code_type_addr =
+                this->code_type_addr == 0 ? 0 : this->code_type_addr + base;
+            res.string_type_addr =
+                this->string_type_addr == 0 ? 0 : this->string_type_addr + base;
             return res;
         }
 
@@ -98,10 +119,21 @@ namespace spiritsaway::cpy_frame
             out << "interp_head_addr:" << py_addr.interp_head_addr << std::endl;
             out << "interp_head_fn_addr:" << py_addr.interp_head_fn_addr << std::endl;
             out << "interp_head_hint:" << py_addr.interp_head_hint << std::endl;
+            out << "frame_type_addr:" << py_addr.frame_type_addr << std::endl;
+            out << "code_type_addr:" << py_addr.code_type_addr << std::endl;
+            out << "string_type_addr:" << py_addr.string_type_addr << std::endl;
             return out;
 
         }
     };
+    // A function symbol of an ELF file, name points into the mapped string table.
+    struct elf_symbol
+    {
+        addr_t addr;
+        addr_t size;
+        const char* name;
+    };
+
     // Representation of an ELF file.
     class ELF
     {
@@ -113,7 +145,15 @@ namespace spiritsaway::cpy_frame
             dynstr_(-1),
             dynsym_(-1),
             strtab_(-1),
-            symtab_(-1)
+            symtab_(-1),
+            gnu_hash_(-1),
+            hash_(-1),
+            debuglink_(-1),
+            ns_(nullptr),
+            debug_searched_(false),
+            symtab_indexed_(false),
+            addr_indexed_(false),
+            parsed_(false)
         {
         }
         ~ELF()
@@ -121,29 +161,83 @@ namespace spiritsaway::cpy_frame
             Close();
         }
 
-        // Open a file
+        // Open a file. ns, if given, must outlive the ELF, separate debug files are
+        // opened through it as well.
         void Open(const std::string& target, Namespace* ns);
 
         // Close the file; normally the destructor will do this automatically.
         void Close();
 
-        // Parse the ELF sections.
+        // Parse the ELF sections. Called on demand by the lookups below, parsing
+        // again is a no-op.
         void Parse();
 
+        // Hex of the NT_GNU_BUILD_ID note, empty if the file has none.
+        std::string BuildId() const;
+
+        // Identity of the file for the SymbolCache: the build-id, or device, inode,
+        // size and mtime when there is none.
+        std::string CacheKey() const;
+
         // Find the DT_NEEDED fields. This is similar to the ldd(1) command.
         std::vector<std::string> NeededLibs();
 
         // Get the address of _PyThreadState_Current & interp_head, and set the Python
-        // ABI.
+        // ABI. Consults the shared and the on-disk SymbolCache before touching the
+        // symbol tables.
         PyAddresses GetAddresses(PyABI* abi);
 
         // Extract the base load address from the Program Header table
         addr_t GetBaseAddress();
 
+        // Look up a defined symbol by name, first through the GNU or SysV hash table
+        // of .dynsym, then through an index of .symtab that is built on first use.
+        // Returns nullptr if this file does not define the symbol.
+        const sym_t* FindSymbol(const char* name);
+
+        // The function symbol containing vaddr, from .symtab and .dynsym. The
+        // address index is built on first use; a symbol without a size extends to
+        // the next one. Returns nullptr if no symbol covers vaddr.
+        const elf_symbol* FindSymbolByAddress(addr_t vaddr);
+
+        // Link-time address of the byte at file_offset, through the PT_LOAD segment
+        // that maps it. Returns false if no segment does.
+        bool FileOffsetToVaddr(size_t file_offset, addr_t& vaddr) const;
+
+        // Whether the link-time address vaddr lies in an executable PT_LOAD
+        // segment.
+        bool IsExecutable(addr_t vaddr) const;
+
+        // Link-time [start, end) of .data and .bss, or of the writable PT_LOAD
+        // segments if the section headers are gone.
+        std::vector<std::pair<addr_t, addr_t>> DataRanges();
+
     private:
         void* addr_;
         size_t length_;
-        int dynamic_, dynstr_, dynsym_, strtab_, symtab_;
+        int dynamic_, dynstr_, dynsym_, strtab_, symtab_, gnu_hash_, hash_, debuglink_;
+        std::string path_;
+        Namespace* ns_;
+        // separate debug file with the .symtab of a stripped file, found through
+        // the build-id or .gnu_debuglink on first use
+        std::unique_ptr<ELF> debug_;
+        bool debug_searched_;
+        // .symtab has no hash table, so one is built on first use: (hash, symbol
+        // index) pairs grouped by bucket, bucket b spans
+        // [symtab_buckets_[b], symtab_buckets_[b + 1])
+        std::vector<std::pair<uint32_t, uint32_t>> symtab_index_;
+        std::vector<uint32_t> symtab_buckets_;
+        bool symtab_indexed_;
+        // function symbols sorted by address
+        std::vector<elf_symbol> addr_index_;
+        bool addr_indexed_;
+        bool parsed_;
+        // device, inode, size and mtime of the opened file
+        std::string stat_key_;
+
+        PyAddresses LookupAddresses(PyABI* abi);
+        // Whether addrs loaded from the on-disk SymbolCache can be used as is.
+        bool TrustCached(const PyAddresses& addrs);
 
         inline const ehdr_t* hdr() const
         {
@@ -189,7 +283,28 @@ namespace spiritsaway::cpy_frame
             return reinterpret_cast<const char*>(p() + strings->sh_offset + offset);
         }
 
-        // Walk the symbol table, and return the detected ABI.
-        PyABI WalkTable(int sym, int str, PyAddresses* addrs);
+        inline const sym_t* symbol(int sym, size_t idx) const
+        {
+            const shdr_t* s = shdr(sym);
+            return reinterpret_cast<const sym_t*>(p() + s->sh_offset + idx * s->sh_entsize);
+        }
+
+        inline const char* symbol_name(int str, const sym_t* sym) const
+        {
+            return reinterpret_cast<const char*>(p() + shdr(str)->sh_offset + sym->st_name);
+        }
+
+        inline size_t symbol_count(int sym) const
+        {
+            const shdr_t* s = shdr(sym);
+            return s->sh_entsize ? s->sh_size / s->sh_entsize : 0;
+        }
+
+        const sym_t* FindGnuHash(const char* name) const;
+        const sym_t* FindSysvHash(const char* name) const;
+        const sym_t* FindSymtab(const char* name);
+        void IndexFunctions(int sym, int str, std::vector<elf_symbol>& index) const;
+        void ParseSections();
+        ELF* DebugFile();
     };
 }
\ No newline at end of file
@@ -0,0 +1,22 @@
+#pragma once
+#include <cstdint>
+
+namespace spiritsaway::cpy_frame
+{
+	// Finalizer of splitmix64, every input bit affects every output bit.
+	inline std::uint64_t hash_mix(std::uint64_t x)
+	{
+		x ^= x >> 30;
+		x *= 0xbf58476d1ce4e5b9ULL;
+		x ^= x >> 27;
+		x *= 0x94d049bb133111ebULL;
+		x ^= x >> 31;
+		return x;
+	}
+
+	// Order dependent combination, unlike xor (a, b) and (b, a) hash differently.
+	inline std::uint64_t hash_combine(std::uint64_t seed, std::uint64_t value)
+	{
+		return hash_mix(seed + 0x9e3779b97f4a7c15ULL + hash_mix(value));
+	}
+}
@@ -0,0 +1,17 @@
+#pragma once
+#include <elf_utils.h>
+#include <memory_map.h>
+#include <remote_memory.h>
+
+namespace spiritsaway::cpy_frame
+{
+	// interp_head is a static variable, so strip drops its symbol. Its address is
+	// decoded from the load in the exported PyInterpreterState_Head where the
+	// code allows, otherwise the .data and .bss of the file holding
+	// _PyThreadState_Current are scanned for a pointer to a PyInterpreterState
+	// whose tstate_head chain points back at it. Returns the remote address of
+	// that pointer, nullptr if there is none yet or the scan found several. A hit
+	// is written to the SymbolCache entry of the file, so later attaches to the
+	// same build skip the search.
+	void* locate_interp_head(RemoteMemory& mem, const MemoryMap& maps, const PyAddresses& addrs);
+}
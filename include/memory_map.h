@@ -0,0 +1,121 @@
+#pragma once
+#include <sys/types.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <remote_memory.h>
+
+namespace spiritsaway::cpy_frame
+{
+	struct mapping
+	{
+		std::uintptr_t start;
+		std::uintptr_t end;
+		std::size_t offset;
+		bool readable;
+		bool writable;
+		bool executable;
+		unsigned long inode;
+		// empty for anonymous mappings, "[heap]" and the like for special ones
+		std::string path;
+
+		inline bool contains(std::uintptr_t addr) const
+		{
+			return start <= addr && addr < end;
+		}
+	};
+
+	// Parsed /proc/<pid>/maps. Mappings never overlap, so the sorted array is its
+	// own interval index and every lookup is a binary search.
+	class MemoryMap
+	{
+	public:
+		explicit MemoryMap(pid_t pid);
+
+		// Re-read the maps file. Parsing is skipped when its content did not
+		// change. Returns true if the mappings changed.
+		bool Refresh();
+
+		// The mapping containing addr, nullptr if it is unmapped.
+		const mapping* Find(std::uintptr_t addr) const;
+
+		inline const mapping* Find(const void* addr) const
+		{
+			return Find(reinterpret_cast<std::uintptr_t>(addr));
+		}
+
+		// True if [addr, addr + n_bytes) lies in readable mappings without a gap.
+		bool Readable(const void* addr, std::size_t n_bytes) const;
+
+		// Load address of a module: the start of the mapping at file offset 0 of
+		// the first file whose path equals name or whose file name starts with it.
+		// Returns 0 if no such file is mapped.
+		std::uintptr_t ModuleBase(const std::string& name, std::string* path = nullptr) const;
+
+		inline const std::vector<mapping>& mappings() const
+		{
+			return mappings_;
+		}
+
+		// Incremented whenever Refresh observes a change.
+		inline std::uint64_t generation() const
+		{
+			return generation_;
+		}
+
+		inline pid_t pid() const
+		{
+			return pid_;
+		}
+
+	private:
+		pid_t pid_;
+		std::string path_;
+		std::string content_;
+		std::vector<mapping> mappings_;
+		std::uint64_t generation_;
+
+		void Parse();
+	};
+
+	// Rejects reads outside the readable mappings of the target before they reach
+	// the backend, so a torn stack full of wild pointers costs binary searches
+	// instead of failing syscalls. A rejected address may belong to a mapping
+	// created after the last refresh, so the map is refreshed once per Rearm
+	// before an address is rejected.
+	class MappedMemory : public RemoteMemory
+	{
+	public:
+		MappedMemory(RemoteMemory& backend, MemoryMap& map);
+
+		RemoteMemoryKind Kind() const override
+		{
+			return backend_.Kind();
+		}
+
+		// A rejected range fails with EFAULT.
+		read_result<void> TryReadV(const remote_chunk* chunks, std::size_t n_chunks) override;
+
+		// Allow one more refresh of the map, normally once per sample.
+		inline void Rearm()
+		{
+			may_refresh_ = true;
+		}
+
+		inline std::size_t rejected() const
+		{
+			return rejected_;
+		}
+
+	private:
+		RemoteMemory& backend_;
+		MemoryMap& map_;
+		bool may_refresh_;
+		std::size_t rejected_;
+
+		bool Check(const void* addr, std::size_t n_bytes);
+	};
+}
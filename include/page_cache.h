@@ -0,0 +1,67 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <unordered_map>
+
+#include <remote_memory.h>
+
+namespace spiritsaway::cpy_frame
+{
+	// Page granular read cache in front of another backend, meant to live for a
+	// single sample. The first touch of a page fetches the whole page in bulk and
+	// later reads of it are served locally, so the cache must be cleared (or
+	// dropped) before the target runs again.
+	//
+	// With the ptrace backend a page costs hundreds of PTRACE_PEEKDATA calls, so
+	// the cache passes reads straight through in that case.
+	class PageCache : public RemoteMemory
+	{
+	public:
+		explicit PageCache(RemoteMemory& backend);
+
+		RemoteMemoryKind Kind() const override
+		{
+			return backend_.Kind();
+		}
+
+		// Pages missing for any of the chunks are fetched in one backend read.
+		read_result<void> TryReadV(const remote_chunk* chunks, std::size_t n_chunks) override;
+
+		// Forget every cached page, the counters are kept.
+		void Clear();
+
+		inline std::size_t hits() const
+		{
+			return hits_;
+		}
+
+		inline std::size_t misses() const
+		{
+			return misses_;
+		}
+
+		inline std::size_t cached_pages() const
+		{
+			return pages_.size();
+		}
+
+		// Of the local kernel, which the target shares.
+		inline std::size_t page_size() const
+		{
+			return page_size_;
+		}
+
+	private:
+		RemoteMemory& backend_;
+		bool bypass_;
+		std::size_t page_size_;
+		std::uintptr_t page_mask_;
+		std::unordered_map<std::uintptr_t, std::unique_ptr<uint8_t[]>> pages_;
+		std::size_t hits_;
+		std::size_t misses_;
+
+		read_result<void> FetchPages(const std::uintptr_t* pages, std::size_t n_pages);
+		void CopyOut(std::uintptr_t addr, uint8_t* dest, std::size_t n_bytes);
+	};
+}
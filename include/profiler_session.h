@@ -0,0 +1,167 @@
+#pragma once
+#include <sys/types.h>
+
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <code_cache.h>
+#include <elf_utils.h>
+#include <memory_map.h>
+#include <python_frame.h>
+#include <remote_call.h>
+#include <remote_memory.h>
+#include <thread_group.h>
+
+namespace spiritsaway::cpy_frame
+{
+	// One attachment to a python process. The ELF parsing, ABI detection and
+	// memory backend probing happen once in the constructor; the session then
+	// keeps the resolved addresses and every cache, so a snapshot only costs the
+	// stack walk. In stop mode every thread of the target is seized, stopped
+	// together for a snapshot and left running between samples; the destructor
+	// detaches.
+	//
+	// A following session (stop mode only) also traces clone, fork and exec, see
+	// ThreadGroup. After an exec the samples are empty until the python symbols of
+	// the new image resolve, or the session ends with a TerminateException when
+	// none did within MAX_ATTACH_WAIT_MS.
+	class ProfilerSession
+	{
+	public:
+		ProfilerSession(pid_t pid, bool non_stop = false, bool follow = false);
+		// Take over a child parent's ThreadGroup reported by TakeForked. It runs
+		// the parent's image, so its addresses are reused without a lookup.
+		ProfilerSession(pid_t child, const ProfilerSession& parent);
+		~ProfilerSession();
+		ProfilerSession(const ProfilerSession& other) = delete;
+		ProfilerSession& operator=(const ProfilerSession& other) = delete;
+
+		// Take one snapshot of every python thread. In stop mode the target is
+		// stopped for the capture only, unless it was paused already. The time the
+		// target spent stopped for this sample is stored in pause_time if given.
+		std::vector<py_thread> Sample(bool enable_py_threads = true);
+		std::vector<interned_py_thread> SampleInterned(bool enable_py_threads = true,
+			std::chrono::nanoseconds* pause_time = nullptr);
+
+		// Keep the target stopped across samples. Not available in non-stop mode.
+		void Pause();
+		void Resume();
+		// Let the threads that stopped for a signal, clone or fork since the last
+		// sample go on, without waiting for the next one. Samplers call it after
+		// every sample; a no-op while paused and in non-stop mode.
+		void Poll();
+		// Release the target, leaving it running. Called by the destructor.
+		void Detach();
+
+		// Children forked since the last call, to be adopted by new sessions.
+		std::vector<pid_t> TakeForked();
+
+		inline pid_t pid() const
+		{
+			return pid_;
+		}
+
+		inline bool non_stop() const
+		{
+			return non_stop_;
+		}
+
+		inline bool following() const
+		{
+			return follow_;
+		}
+
+		// The target exec'd and its new image is not resolved yet.
+		inline bool exec_pending() const
+		{
+			return exec_pending_;
+		}
+
+		inline bool attached() const
+		{
+			return attached_;
+		}
+
+		inline bool paused() const
+		{
+			return paused_;
+		}
+
+		inline const PyAddresses& addresses() const
+		{
+			return addrs_;
+		}
+
+		inline PyABI abi() const
+		{
+			return abi_;
+		}
+
+		// Reads outside the mapped memory of the target are rejected up front.
+		inline RemoteMemory& memory()
+		{
+			return *checked_mem_;
+		}
+
+		inline MemoryMap& maps()
+		{
+			return *maps_;
+		}
+
+		inline CodeCache& codes()
+		{
+			return *codes_;
+		}
+
+		inline const StringTable& strings() const
+		{
+			return codes_->strings();
+		}
+
+		inline ChainCache& chains()
+		{
+			return chains_;
+		}
+
+		// Every thread of the target in stop mode, nullptr in non-stop mode. Its
+		// stats() describe the last Pause.
+		inline const ThreadGroup* threads() const
+		{
+			return threads_.get();
+		}
+
+		// Runs functions in the target while it is paused, nullptr in non-stop
+		// mode. Attaching unmaps its page after use, a later call maps it again
+		// until detach.
+		inline RemoteCaller* caller()
+		{
+			return caller_.get();
+		}
+
+	private:
+		const pid_t pid_;
+		const bool non_stop_;
+		const bool follow_;
+		bool attached_ = false;
+		bool exec_pending_ = false;
+		std::chrono::steady_clock::time_point exec_deadline_;
+		std::string exec_candidates_;
+		bool paused_ = false;
+		PyABI abi_ = PyABI::Unknown;
+		PyAddresses addrs_;
+		std::unique_ptr<RemoteMemory> mem_;
+		std::unique_ptr<MemoryMap> maps_;
+		std::unique_ptr<MappedMemory> checked_mem_;
+		std::unique_ptr<CodeCache> codes_;
+		ChainCache chains_;
+		std::unique_ptr<RemoteCaller> caller_;
+		std::unique_ptr<ThreadGroup> threads_;
+
+		void Setup();
+		void CheckAttached() const;
+		bool ResolveAfterExec();
+		std::vector<interned_py_thread> InternThreads(const std::vector<py_thread>& py_threads);
+	};
+}
@@ -10,9 +10,51 @@ namespace spiritsaway::cpy_frame
 #ifdef __arm__
 	using user_regs_struct = user_regs;
 #endif // __arm__
+	// one element of a scatter/gather remote read: copy len bytes at remote addr into dest
+	struct remote_chunk
+	{
+		void* addr;
+		void* dest;
+		std::size_t len;
+	};
+
+	// Why a remote read failed: errno of the failing call and the remote address.
+	// Two words, so racing reads that fail routinely cost no message and no
+	// unwinding; the throwing APIs build the message from it.
+	struct read_error
+	{
+		int err;
+		void* addr;
+	};
+	template <typename T>
+	using read_result = tl::expected<T, read_error>;
+
+	inline tl::unexpected<read_error> read_failure(int err, void* addr)
+	{
+		return tl::make_unexpected(read_error{ err, addr });
+	}
+
+	// Throws the PtraceException a failed read of pid is reported with.
+	[[noreturn]] void throw_read_error(pid_t pid, const read_error& error);
 	user_regs_struct ptrace_get_regs(pid_t pid);
 	std::string ptrace_peek_string(pid_t, void* addr);
 	std::unique_ptr<uint8_t[]> ptrace_peek_bytes(pid_t pid, void* addr, std::size_t n_bytes);
+	// bulk remote reads through process_vm_readv, falling back to PTRACE_PEEKDATA
+	// when the syscall is not available (old kernel, seccomp policy)
+	void ptrace_read(pid_t pid, void* addr, void* dest, std::size_t n_bytes);
+	void ptrace_readv(pid_t pid, const remote_chunk* chunks, std::size_t n_chunks);
+	// the two halves of ptrace_readv: ptrace_vm_readv returns false if process_vm_readv
+	// can not be used for this pid at all, both throw on a bad remote address
+	bool ptrace_vm_readv(pid_t pid, const remote_chunk* chunks, std::size_t n_chunks);
+	void ptrace_peek_read(pid_t pid, void* addr, void* dest, std::size_t n_bytes);
+	// Non-throwing forms of the reads above and below. try_ptrace_vm_readv yields
+	// false where ptrace_vm_readv returns false.
+	read_result<long> try_ptrace_peek(pid_t pid, void* addr);
+	read_result<void*> try_ptrace_peek_ptr(pid_t pid, void* addr);
+	read_result<void> try_ptrace_peek_read(pid_t pid, void* addr, void* dest, std::size_t n_bytes);
+	read_result<bool> try_ptrace_vm_readv(pid_t pid, const remote_chunk* chunks, std::size_t n_chunks);
+	read_result<void> try_ptrace_readv(pid_t pid, const remote_chunk* chunks, std::size_t n_chunks);
+	read_result<void> try_ptrace_read(pid_t pid, void* addr, void* dest, std::size_t n_bytes);
 	void ptrace_cleanup(pid_t pid);
 	void ptrace_attach(pid_t pid);
 	void ptrace_detach(pid_t pid);
@@ -20,7 +62,12 @@ namespace spiritsaway::cpy_frame
 	void* ptrace_peek_ptr(pid_t pid, void* addr);
 	void ptrace_condition(pid_t pid);
 	void ptrace_interrupt(pid_t pid);
-	long ptrace_call_function(pid_t pid, long);
+	// Stop a PTRACE_SEIZEd tracee and wait for its PTRACE_EVENT_STOP. Signals that
+	// reach the tracee meanwhile are delivered instead of failing the stop.
+	void ptrace_stop(pid_t pid);
+	// Deliver the signals a running PTRACE_SEIZEd tracee stopped for, without
+	// blocking. A tracee nobody waits on would sit in its signal-delivery-stop.
+	void ptrace_pass_signals(pid_t pid);
 	void ptrace_poke(pid_t pid, void* addr, void* data);
 	void ptrace_set_regs(pid_t pid, user_regs_struct regs);
 	void ptrace_single_step(pid_t pid);
@@ -0,0 +1,196 @@
+#pragma once
+#include <sys/types.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include <profiler_session.h>
+#include <stack_trie.h>
+
+namespace spiritsaway::cpy_frame
+{
+	struct sampler_options
+	{
+		double rate_hz = 100.0;
+		// 0 keeps sampling until the stop flag passed to Run is set
+		std::chrono::milliseconds duration{ 0 };
+		bool enable_py_threads = true;
+		// read the stacks without stopping the target, see trace_py_threads_nonstop
+		bool non_stop = false;
+	};
+
+	struct sampler_stats
+	{
+		std::uint64_t ticks = 0;
+		std::uint64_t samples = 0;
+		// ticks skipped because the previous sample overran its slot
+		std::uint64_t missed_ticks = 0;
+		// PoolSampler: ticks skipped to keep the target within its overhead budget
+		std::uint64_t throttled_ticks = 0;
+		// samples aborted by a failed remote read
+		std::uint64_t failed_samples = 0;
+		// non-stop stacks that could not be verified
+		std::uint64_t best_effort_threads = 0;
+		// time the target spent stopped by us
+		std::chrono::nanoseconds pause_time{ 0 };
+		std::chrono::nanoseconds max_pause{ 0 };
+		// stop mode: until every thread stopped, and the spread of their stops
+		std::chrono::nanoseconds freeze_time{ 0 };
+		std::chrono::nanoseconds max_freeze_skew{ 0 };
+		std::size_t frozen_threads = 0;
+		// time spent in sampling, including symbolization
+		std::chrono::nanoseconds sample_time{ 0 };
+
+		friend std::ostream& operator<<(std::ostream& os, const sampler_stats& stats)
+		{
+			os << "ticks " << stats.ticks << " samples " << stats.samples
+				<< " missed " << stats.missed_ticks << " throttled " << stats.throttled_ticks
+				<< " failed " << stats.failed_samples
+				<< " best_effort_threads " << stats.best_effort_threads << std::endl;
+			const auto n = stats.samples ? stats.samples : 1;
+			os << "pause total " << stats.pause_time.count() / 1000 << "us avg "
+				<< stats.pause_time.count() / n / 1000 << "us max " << stats.max_pause.count() / 1000
+				<< "us, sample avg " << stats.sample_time.count() / n / 1000 << "us" << std::endl;
+			if (stats.frozen_threads)
+			{
+				os << "freeze avg " << stats.freeze_time.count() / n / 1000 << "us of " << stats.frozen_threads
+					<< " threads, skew max " << stats.max_freeze_skew.count() / 1000 << "us" << std::endl;
+			}
+			return os;
+		}
+	};
+
+	// Continuous profiler: attach to a python process once, then sample all of its
+	// python threads at a fixed rate and aggregate the stacks into a call tree.
+	// Ticks are scheduled at start + k * period, so the rate does not drift with
+	// the sampling cost; ticks that pass while a sample overruns are skipped and
+	// counted as missed.
+	class PySampler
+	{
+	public:
+		PySampler(pid_t pid, const sampler_options& options);
+
+		// Attach, sample until the duration elapsed or *stop becomes true, then
+		// detach again.
+		const sampler_stats& Run(const std::atomic<bool>* stop = nullptr);
+
+		inline const StackTrie& trie() const
+		{
+			return trie_;
+		}
+
+		// Names of the ids in trie(), only valid after Run.
+		inline const StringTable& strings() const
+		{
+			return session_->strings();
+		}
+
+		inline const sampler_stats& stats() const
+		{
+			return stats_;
+		}
+
+	private:
+		pid_t pid_;
+		sampler_options options_;
+		sampler_stats stats_;
+		StackTrie trie_;
+		std::unique_ptr<ProfilerSession> session_;
+
+		void SampleOnce();
+	};
+
+	struct pool_options
+	{
+		// per target
+		double rate_hz = 100.0;
+		std::chrono::milliseconds duration{ 0 };
+		bool enable_py_threads = true;
+		bool non_stop = false;
+		// also sample the children the targets fork and follow execs, stop mode only
+		bool follow = false;
+		// sampling threads, 0 for one per hardware thread; never more than targets
+		std::size_t workers = 0;
+		// share of its wall time a target may lose to sampling: the pause in stop
+		// mode, the sample itself in non-stop mode. Ticks over budget are skipped.
+		double max_overhead = 0.05;
+	};
+
+	struct pool_target
+	{
+		pid_t pid;
+		sampler_stats stats;
+		// why the target was not attached or was lost, empty otherwise
+		std::string error;
+	};
+
+	// Samples many python processes at once, e.g. the workers of a prefork server.
+	// Only the thread that attached may ptrace a target, so every target is pinned
+	// to one of a pool of sampling threads. Each thread serves its targets earliest
+	// deadline first from staggered start ticks, and a target whose samples cost
+	// more than max_overhead of its time is sampled less often instead of delaying
+	// the others. Interpreter symbols are resolved once per build, see
+	// SymbolCache::LoadShared. When following, forked children become targets of
+	// the thread that traced their parent.
+	class PoolSampler
+	{
+	public:
+		PoolSampler(const std::vector<pid_t>& pids, const pool_options& options);
+		~PoolSampler();
+		PoolSampler(const PoolSampler& other) = delete;
+		PoolSampler& operator=(const PoolSampler& other) = delete;
+
+		// Attach, sample until the duration elapsed or *stop becomes true, then
+		// detach again. Returns the stats summed over the targets.
+		const sampler_stats& Run(const std::atomic<bool>* stop = nullptr);
+
+		// The stacks of every target, only valid after Run.
+		inline const StackTrie& trie() const
+		{
+			return trie_;
+		}
+
+		inline const StringTable& strings() const
+		{
+			return strings_;
+		}
+
+		// Either the merged profile or every target's under a "pid <pid>" frame.
+		void WriteFolded(std::ostream& os, bool per_pid) const;
+
+		inline const std::vector<pool_target>& targets() const
+		{
+			return targets_;
+		}
+
+		inline const sampler_stats& stats() const
+		{
+			return stats_;
+		}
+
+		inline std::size_t workers() const
+		{
+			return workers_;
+		}
+
+	private:
+		struct target_state;
+
+		pool_options options_;
+		std::size_t workers_;
+		std::vector<pool_target> targets_;
+		std::vector<std::unique_ptr<target_state>> states_;
+		sampler_stats stats_;
+		StackTrie trie_;
+		StringTable strings_;
+
+		void RunWorker(std::size_t worker, std::chrono::steady_clock::time_point start,
+			const std::atomic<bool>* stop, std::vector<std::unique_ptr<target_state>>* born);
+	};
+}
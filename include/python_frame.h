@@ -1,17 +1,38 @@
 #pragma once
+#include <cstdint>
 #include <string>
+#include <unordered_map>
+#include <vector>
 #include <ostream>
 #include "elf_utils.h"
+#include "remote_memory.h"
+#include "code_cache.h"
+#include "hash_utils.h"
+#include "memory_map.h"
+#include "remote_call.h"
 namespace spiritsaway::cpy_frame
 {
 	// Maximum number of times to retry checking for Python symbols when -p is used.
 #define MAX_ATTACH_RETRIES 1
 
-// Maximum number of times to retry checking for Python symbols when -t is used.
-#define MAX_TRACE_RETRIES 50
+// How long to wait for the Python symbols of the target to show up on attach.
+#define MAX_ATTACH_WAIT_MS 5000
+
+// How often the maps of the target are polled meanwhile: the interval starts
+// here, doubles up to the maximum while nothing changes, and starts over when
+// the mappings did change.
+#define ATTACH_POLL_INTERVAL_MS 1
+#define ATTACH_POLL_MAX_INTERVAL_MS 64
+
+// Maximum number of times to re-walk a torn stack in non-stop mode.
+#define MAX_NONSTOP_RETRIES 3
+
+// Frame chains deeper than this are considered torn in non-stop mode.
+#define MAX_NONSTOP_DEPTH 4096
+
+// Thread lists longer than this are considered torn in non-stop mode.
+#define MAX_NONSTOP_THREADS 65536
 
-	std::size_t locate_lib_python(pid_t pid, const std::string& hint, std::string& path);
-	
 
 	struct pyframe
 	{
@@ -21,7 +42,7 @@ namespace spiritsaway::cpy_frame
 		std::size_t line;
 		inline bool operator==(const pyframe& other) const
 		{
-			return file == other.file && line == other.line;
+			return file == other.file && name == other.name && line == other.line;
 		}
 
 		friend std::ostream& operator<<(std::ostream& os, const pyframe& fr)
@@ -32,26 +53,117 @@ namespace spiritsaway::cpy_frame
 
 	};
 	using pyframes_t = std::vector<pyframe>;
+	// Hash of a whole stack, consistent with pyframe::operator== (the frame
+	// address is not part of it).
 	struct pyframe_hash
 	{
 		std::size_t operator()(const pyframes_t& _fr_v) const
 		{
-			std::size_t hash = 0;
-			for (size_t i = 0; i < _fr_v.size(); i++)
+			std::uint64_t hash = _fr_v.size();
+			for (const auto& frame : _fr_v)
 			{
-				hash ^= std::hash<size_t>()(i);
-				hash ^= std::hash<std::string>()(_fr_v[i].file);
+				hash = hash_combine(hash, std::hash<std::string>()(frame.file));
+				hash = hash_combine(hash, std::hash<std::string>()(frame.name));
+				hash = hash_combine(hash, frame.line);
 			}
-			return hash;
+			return static_cast<std::size_t>(hash);
 		}
 	};
+	// codes may be a cache kept across samples, nullptr resolves every code object
+	// afresh
+	pyframes_t trace_py_frames(RemoteMemory& mem, void* frame_addr, CodeCache* codes = nullptr);
 	pyframes_t trace_py_frames(pid_t pid, void* frame_addr);
+	// Same walk without exceptions: a failed read ends it with its read_error, a
+	// frame whose f_code is not a code object with EINVAL at f_code.
+	read_result<pyframes_t> try_trace_py_frames(RemoteMemory& mem, void* frame_addr, CodeCache* codes = nullptr);
+
+	// A frame as captured while the target is stopped: remote identifiers only,
+	// file, name and line are resolved later by symbolize_py_threads.
+	struct raw_pyframe
+	{
+		void* addr;
+		void* code;
+		int lasti;
+		// f_lineno if the frame is traced, -1 otherwise
+		int lineno;
+	};
+
+	// The threads of one sample as ranges into a single flat frame array.
+	struct raw_py_thread
+	{
+		void* id;
+		bool is_current;
+		std::uint32_t first_frame;
+		std::uint32_t n_frames;
+	};
+
+	struct raw_sample
+	{
+		std::vector<raw_py_thread> threads;
+		std::vector<raw_pyframe> frames;
+	};
+
+	// Frame chain of one thread as seen by the previous sample, innermost first.
+	struct thread_chain
+	{
+		std::vector<raw_pyframe> frames;
+		// resolved frames parallel to frames, empty for chains kept by the capture
+		// path
+		pyframes_t resolved;
+		std::unordered_map<void*, std::uint32_t> positions;
+
+		// Position of the frame at addr if it is still the same frame object, that
+		// is it runs the same code and has the same f_back, -1 otherwise.
+		int Match(void* addr, void* code, void* f_back) const;
+	};
+
+	// The chains of every thread from the previous sample. Between consecutive
+	// samples the outer frames of a thread (main loop, request handler) rarely
+	// change, so a walk stops at the first frame that matches the cached chain and
+	// splices in the cached remainder instead of walking it again. Only f_lasti,
+	// f_lineno and f_trace of the spliced frames are read again.
+	class ChainCache
+	{
+	public:
+		const thread_chain* Find(void* thread_id) const;
+
+		// Keep chain as the latest chain of thread_id.
+		void Store(void* thread_id, thread_chain&& chain);
+
+		// Drop the chains of threads that were not stored since the last call.
+		void EndSample();
+
+		inline std::size_t walked_frames() const
+		{
+			return walked_frames_;
+		}
+
+		inline std::size_t reused_frames() const
+		{
+			return reused_frames_;
+		}
+
+		void CountFrames(std::size_t walked, std::size_t reused)
+		{
+			walked_frames_ += walked;
+			reused_frames_ += reused;
+		}
+
+	private:
+		std::unordered_map<void*, thread_chain> chains_;
+		std::unordered_map<void*, thread_chain> next_chains_;
+		std::size_t walked_frames_ = 0;
+		std::size_t reused_frames_ = 0;
+	};
 
 	struct py_thread
 	{
 		void* id;
 		bool is_current;
 		pyframes_t frames;
+		// false if the stack was read from a running target and could not be
+		// verified, the frames are then a best-effort guess
+		bool consistent = true;
 		friend std::ostream& operator<<(std::ostream& os, const py_thread& this_py_thread)
 		{
 			os << this_py_thread.id;
@@ -59,6 +171,10 @@ namespace spiritsaway::cpy_frame
 			{
 				os << '*';
 			}
+			if (!this_py_thread.consistent)
+			{
+				os << '?';
+			}
 			os << ';' << std::endl;
 			for (const auto& frame : this_py_thread.frames)
 			{
@@ -67,7 +183,84 @@ namespace spiritsaway::cpy_frame
 			return os;
 		}
 	};
+	std::vector<py_thread> trace_py_threads(RemoteMemory& mem, PyAddresses py_addr, bool enable_py_threads,
+		CodeCache* codes = nullptr, ChainCache* chains = nullptr);
 	std::vector<py_thread> trace_py_threads(pid_t pid, PyAddresses py_addr, bool enable_py_threads);
+	// Non-throwing trace_py_threads, failing like try_trace_py_frames.
+	read_result<std::vector<py_thread>> try_trace_py_threads(RemoteMemory& mem, PyAddresses py_addr,
+		bool enable_py_threads, CodeCache* codes = nullptr, ChainCache* chains = nullptr);
+
+	// Read the stacks without stopping the target. Torn chains are detected with
+	// ob_type checks, f_back sanity and a re-read of tstate->frame, and re-walked
+	// up to max_retries times before being reported as best-effort.
+	std::vector<py_thread> trace_py_threads_nonstop(RemoteMemory& mem, PyAddresses py_addr,
+		bool enable_py_threads, std::size_t max_retries = MAX_NONSTOP_RETRIES, CodeCache* codes = nullptr);
+
+	// Append the raw frames of the chain starting at frame_addr, this is the bare
+	// pointer chase with one read per frame. With previous set the walk stops at
+	// the first frame that matches it, returns the number of frames spliced in
+	// from previous.
+	std::size_t capture_py_frames(RemoteMemory& mem, void* frame_addr, std::vector<raw_pyframe>& frames,
+		const thread_chain* previous = nullptr);
+	raw_sample capture_py_threads(RemoteMemory& mem, PyAddresses py_addr, bool enable_py_threads,
+		ChainCache* chains = nullptr);
+	// Non-throwing forms of the two above, a failed read is returned as is.
+	read_result<std::size_t> try_capture_py_frames(RemoteMemory& mem, void* frame_addr,
+		std::vector<raw_pyframe>& frames, const thread_chain* previous = nullptr);
+	read_result<raw_sample> try_capture_py_threads(RemoteMemory& mem, PyAddresses py_addr, bool enable_py_threads,
+		ChainCache* chains = nullptr);
+
+	// A resolved frame whose file and name are ids into the StringTable of the
+	// CodeCache that resolved it: three words instead of two std::string copies.
+	struct interned_pyframe
+	{
+		std::uint32_t file;
+		std::uint32_t name;
+		std::uint32_t line;
+		inline bool operator==(const interned_pyframe& other) const
+		{
+			return file == other.file && name == other.name && line == other.line;
+		}
+	};
+	using interned_pyframes_t = std::vector<interned_pyframe>;
+
+	struct interned_pyframe_hash
+	{
+		std::size_t operator()(const interned_pyframe& frame) const
+		{
+			const std::uint64_t ids = (static_cast<std::uint64_t>(frame.file) << 32) | frame.name;
+			return static_cast<std::size_t>(hash_combine(hash_mix(ids), frame.line));
+		}
+	};
+
+	struct interned_py_thread
+	{
+		void* id;
+		bool is_current;
+		interned_pyframes_t frames;
+		bool consistent = true;
+	};
+
+	// Resolve a captured sample, normally after the target was resumed. Code
+	// objects that are no longer valid show up as "<unknown>" frames.
+	std::vector<py_thread> symbolize_py_threads(RemoteMemory& mem, CodeCache& codes, const raw_sample& sample);
+	std::vector<interned_py_thread> symbolize_py_threads_interned(RemoteMemory& mem, CodeCache& codes,
+		const raw_sample& sample);
+
+	// Seize pid (unless non_stop) and resolve the python symbols, retrying while
+	// libpython is not loaded yet. In stop mode the target is left stopped. The
+	// detected ABI is stored in abi if given. A remote call the attach can not do
+	// without runs through caller, or through a page released before returning.
+	PyAddresses attach_python(pid_t pid, bool non_stop, PyABI* abi = nullptr, RemoteCaller* caller = nullptr);
+
+	// One attempt of the lookup attach_python retries, without waiting, for a
+	// seized and stopped target that exec'd. candidates keeps what the last
+	// attempt saw, the lookup only runs again once the executable or a libpython
+	// mapping changed. Returns false until it succeeds.
+	bool try_resolve_python(pid_t pid, const MemoryMap& maps, RemoteCaller* caller, std::string& candidates,
+		PyAddresses& addrs);
 
-	std::vector<py_thread> dump_py_threads(pid_t pid, bool enable_py_threads);
+	// One-shot snapshot: attach, sample once and detach. Use a ProfilerSession to
+	// take repeated snapshots of the same process.
+	std::vector<py_thread> dump_py_threads(pid_t pid, bool enable_py_threads, bool non_stop = false);
 }
\ No newline at end of file
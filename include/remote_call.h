@@ -0,0 +1,70 @@
+#pragma once
+#include <sys/types.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <initializer_list>
+#include <vector>
+
+namespace spiritsaway::cpy_frame
+{
+	// One function call to run in the target. Up to six integer or pointer
+	// arguments are passed in registers as the SysV x86_64 ABI does.
+	struct remote_call
+	{
+		void* fn;
+		std::vector<long> args;
+		// the value of rax when fn returned
+		long result;
+	};
+
+	// Runs functions of one stopped, PTRACE_SEIZEd target on a page mapped into
+	// it. The page is mapped on the first call by single stepping a syscall
+	// instruction the target already has, so none of its code is patched and its
+	// other threads keep running; children they fork do not inherit it. A batch
+	// of calls is one trampoline on the page and costs a single PTRACE_CONT.
+	// Signals arriving during a call are held back and queued on the thread
+	// again after its registers are restored. x86_64 only.
+	class RemoteCaller
+	{
+	public:
+		explicit RemoteCaller(pid_t pid);
+		// Releases the page if the target is still stopped, errors are ignored.
+		~RemoteCaller();
+		RemoteCaller(const RemoteCaller& other) = delete;
+		RemoteCaller& operator=(const RemoteCaller& other) = delete;
+
+		long Call(void* fn, std::initializer_list<long> args = {});
+		// Run every call in order, storing each return value in its result.
+		void CallBatch(remote_call* calls, std::size_t n_calls);
+
+		// Unmap the page, the next call maps it again. The target has to be
+		// stopped, so this is done before detaching rather than left to the
+		// destructor.
+		void Release();
+		// Forget the page without unmapping it, after the target exec'd and lost it.
+		void Abandon();
+
+		inline pid_t pid() const
+		{
+			return pid_;
+		}
+
+		// Remote address of the page, 0 if none is mapped.
+		inline std::uintptr_t page() const
+		{
+			return page_;
+		}
+
+	private:
+		pid_t pid_;
+		std::uintptr_t page_;
+		std::size_t page_size_;
+		std::uintptr_t syscall_insn_;
+
+		long Syscall(long number, std::initializer_list<long> args);
+		std::uintptr_t FindSyscallInsn() const;
+		void Write(std::uintptr_t addr, const std::vector<std::uint8_t>& bytes);
+		std::size_t RunBatch(remote_call* calls, std::size_t n_calls);
+	};
+}
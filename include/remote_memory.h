@@ -0,0 +1,125 @@
+#pragma once
+#include <sys/types.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include <ptrace_wrapper.h>
+
+namespace spiritsaway::cpy_frame
+{
+	// The way we read the memory of the target process. Listed from the cheapest
+	// to the most expensive one.
+	enum class RemoteMemoryKind
+	{
+		VmReadv = 0,  // process_vm_readv, one syscall for a whole scatter list
+		ProcMem = 1,  // pread/preadv on /proc/<pid>/mem
+		Ptrace = 2,   // PTRACE_PEEKDATA, one syscall per word
+	};
+
+	const char* remote_memory_kind_name(RemoteMemoryKind kind);
+
+	// Read-only view of the address space of a target process. The Try reads
+	// report an unreadable remote range as a read_error, every other read throws
+	// PtraceException for it.
+	class RemoteMemory
+	{
+	public:
+		explicit RemoteMemory(pid_t pid)
+			: pid_(pid)
+		{
+		}
+		virtual ~RemoteMemory() = default;
+
+		virtual RemoteMemoryKind Kind() const = 0;
+
+		// Scatter read, the one primitive of every backend. Fails at the first
+		// chunk that is not readable, the others may be filled or not.
+		virtual read_result<void> TryReadV(const remote_chunk* chunks, std::size_t n_chunks) = 0;
+
+		read_result<void> TryRead(void* addr, void* dest, std::size_t n_bytes);
+
+		read_result<void*> TryReadPtr(void* addr);
+
+		void Read(void* addr, void* dest, std::size_t n_bytes);
+
+		void ReadV(const remote_chunk* chunks, std::size_t n_chunks);
+
+		inline pid_t pid() const
+		{
+			return pid_;
+		}
+
+		void* ReadPtr(void* addr);
+
+		long ReadLong(void* addr);
+
+		// Read a NUL terminated string.
+		std::string ReadString(void* addr);
+
+		std::unique_ptr<uint8_t[]> ReadBytes(void* addr, std::size_t n_bytes);
+
+		// Create the backend of the given kind. Opening /proc/<pid>/mem may throw.
+		static std::unique_ptr<RemoteMemory> Create(pid_t pid, RemoteMemoryKind kind);
+
+		// Try every backend from the cheapest to the most expensive one and return
+		// the first that can read sizeof(void*) bytes at probe_addr.
+		static std::unique_ptr<RemoteMemory> Probe(pid_t pid, void* probe_addr);
+
+	protected:
+		pid_t pid_;
+	};
+
+	class PtraceMemory : public RemoteMemory
+	{
+	public:
+		explicit PtraceMemory(pid_t pid)
+			: RemoteMemory(pid)
+		{
+		}
+		RemoteMemoryKind Kind() const override
+		{
+			return RemoteMemoryKind::Ptrace;
+		}
+		read_result<void> TryReadV(const remote_chunk* chunks, std::size_t n_chunks) override;
+	};
+
+	class ProcMemMemory : public RemoteMemory
+	{
+	public:
+		explicit ProcMemMemory(pid_t pid);
+		~ProcMemMemory();
+		RemoteMemoryKind Kind() const override
+		{
+			return RemoteMemoryKind::ProcMem;
+		}
+
+		// Chunks that are adjacent in the target are merged into one preadv.
+		read_result<void> TryReadV(const remote_chunk* chunks, std::size_t n_chunks) override;
+
+	private:
+		int fd_;
+	};
+
+	// Falls back to PTRACE_PEEKDATA for good once process_vm_readv is refused
+	// for this target, and reports the Ptrace kind from then on.
+	class VmReadvMemory : public RemoteMemory
+	{
+	public:
+		explicit VmReadvMemory(pid_t pid)
+			: RemoteMemory(pid),
+			refused_(false)
+		{
+		}
+		RemoteMemoryKind Kind() const override
+		{
+			return refused_ ? RemoteMemoryKind::Ptrace : RemoteMemoryKind::VmReadv;
+		}
+		read_result<void> TryReadV(const remote_chunk* chunks, std::size_t n_chunks) override;
+
+	private:
+		bool refused_;
+	};
+}
@@ -0,0 +1,92 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include <python_frame.h>
+#include <string_table.h>
+
+namespace spiritsaway::cpy_frame
+{
+	// Call tree of interned stacks. Node 0 is the root, every other node is one
+	// frame called from its parent. A node counts the samples whose innermost
+	// frame it was (self) and the samples that passed through it (total). Nodes are
+	// never removed, so a node id is a stable id of the stack ending in it.
+	class StackTrie
+	{
+	public:
+		static constexpr std::uint32_t root = 0;
+
+		struct node
+		{
+			interned_pyframe frame;
+			std::uint32_t parent;
+			std::uint32_t depth;
+			std::uint64_t self_count;
+			std::uint64_t total_count;
+		};
+
+		StackTrie();
+
+		// frames are innermost first, the way they are sampled. Returns the node of
+		// the innermost frame.
+		std::uint32_t Insert(const interned_pyframe* frames, std::size_t n_frames, std::uint64_t count = 1);
+
+		inline std::uint32_t Insert(const interned_pyframes_t& frames, std::uint64_t count = 1)
+		{
+			return Insert(frames.data(), frames.size(), count);
+		}
+
+		// The stack ending at node_id, innermost first.
+		interned_pyframes_t Stack(std::uint32_t node_id) const;
+
+		inline const node& Node(std::uint32_t node_id) const
+		{
+			return nodes_[node_id];
+		}
+
+		inline std::size_t size() const
+		{
+			return nodes_.size();
+		}
+
+		inline std::uint64_t samples() const
+		{
+			return nodes_[root].total_count;
+		}
+
+		// Add every stack of other, whose ids refer to other_strings, to this trie,
+		// whose ids refer to strings.
+		void Merge(const StackTrie& other, const StringTable& other_strings, StringTable& strings);
+
+		// Collapsed stack format of flamegraph.pl: one line per stack with a self
+		// count, outermost frame first, frames separated by ';'. A non-empty prefix
+		// is written as an extra outermost frame.
+		void WriteFolded(std::ostream& os, const StringTable& strings, std::string_view prefix = {}) const;
+
+	private:
+		struct child_key
+		{
+			std::uint32_t parent;
+			interned_pyframe frame;
+			inline bool operator==(const child_key& other) const
+			{
+				return parent == other.parent && frame == other.frame;
+			}
+		};
+
+		struct child_key_hash
+		{
+			std::size_t operator()(const child_key& key) const
+			{
+				return static_cast<std::size_t>(hash_combine(key.parent, interned_pyframe_hash()(key.frame)));
+			}
+		};
+
+		std::vector<node> nodes_;
+		std::unordered_map<child_key, std::uint32_t, child_key_hash> children_;
+	};
+}
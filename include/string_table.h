@@ -0,0 +1,72 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+#include <remote_memory.h>
+
+namespace spiritsaway::cpy_frame
+{
+	// Interned copies of python strings. Every distinct string is stored once and
+	// known by a small id, so frames can carry ids instead of std::string copies.
+	//
+	// Remote strings are keyed by their PyStringObject*: the characters are read
+	// on the first lookup only, later lookups read the object header and check
+	// that ob_size and ob_shash still match to detect a freed and reused address.
+	// A string whose hash was never computed is read on every lookup.
+	class StringTable
+	{
+	public:
+		static constexpr std::uint32_t invalid_id = UINT32_MAX;
+
+		StringTable() = default;
+		// string_type_addr is the remote PyString_Type, 0 skips the ob_type check
+		explicit StringTable(void* string_type_addr);
+
+		// Check remote strings against a new type and forget their addresses,
+		// after the target exec'd. Ids handed out stay valid.
+		void Retarget(void* string_type_addr);
+
+		std::uint32_t Intern(std::string_view str);
+
+		// Intern the remote PyStringObject at str_obj.
+		std::uint32_t Get(RemoteMemory& mem, void* str_obj);
+		// An object that is not a string or is longer than 64 KB fails with
+		// EINVAL.
+		read_result<std::uint32_t> TryGet(RemoteMemory& mem, void* str_obj);
+
+		inline const std::string& Str(std::uint32_t id) const
+		{
+			return strings_[id];
+		}
+
+		inline std::size_t size() const
+		{
+			return strings_.size();
+		}
+
+		inline std::size_t remote_reads() const
+		{
+			return remote_reads_;
+		}
+
+	private:
+		struct remote_string
+		{
+			long size;
+			long hash;
+			std::uint32_t id;
+		};
+
+		// a deque keeps the strings in place, ids_ holds views into them
+		std::deque<std::string> strings_;
+		std::unordered_map<std::string_view, std::uint32_t> ids_;
+		// bounded, cleared once full
+		std::unordered_map<void*, remote_string> remote_ids_;
+		void* string_type_addr_ = nullptr;
+		std::size_t remote_reads_ = 0;
+	};
+}
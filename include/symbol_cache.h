@@ -0,0 +1,47 @@
+#pragma once
+#include <string>
+
+#include <elf_utils.h>
+
+namespace spiritsaway::cpy_frame
+{
+	// Persistent map from the identity of an ELF file (see ELF::CacheKey) to the
+	// python symbols ELF::GetAddresses found in it. The same interpreter builds run
+	// in many processes, so attaching to a known one only reads one small file
+	// instead of walking the symbol tables. Every failure to read or write the
+	// cache is treated as a miss, and so is an entry that is not owned by the
+	// effective uid or that others may write: its addresses end up called in
+	// the target. Directories are created with mode 0700.
+	class SymbolCache
+	{
+	public:
+		explicit SymbolCache(const std::string& dir);
+
+		// Addresses are stored as ELF::GetAddresses returns them, before they are
+		// relocated to the load address of the file.
+		bool Load(const std::string& key, PyAddresses& addrs, PyABI& abi) const;
+		void Store(const std::string& key, const PyAddresses& addrs, PyABI abi) const;
+
+		inline const std::string& dir() const
+		{
+			return dir_;
+		}
+
+		// The cache used by ELF::GetAddresses: $CPY_FRAME_SYMBOL_CACHE, else
+		// $XDG_CACHE_HOME/cpp_py_frame, else ~/.cache/cpp_py_frame. Setting
+		// CPY_FRAME_SYMBOL_CACHE to an empty string disables it, then nullptr is
+		// returned.
+		static const SymbolCache* Default();
+
+		// Process-wide copies of the entries, so the workers of a pool that attach
+		// to the same interpreter build resolve it once. Independent of Default,
+		// they are kept even when the on-disk cache is disabled.
+		static bool LoadShared(const std::string& key, PyAddresses& addrs, PyABI& abi);
+		static void StoreShared(const std::string& key, const PyAddresses& addrs, PyABI abi);
+
+	private:
+		std::string dir_;
+
+		std::string Path(const std::string& key) const;
+	};
+}
@@ -0,0 +1,107 @@
+#pragma once
+#include <sys/types.h>
+
+#include <chrono>
+#include <cstddef>
+#include <vector>
+
+namespace spiritsaway::cpy_frame
+{
+	// The thread ids in /proc/<pid>/task.
+	std::vector<pid_t> list_threads(pid_t pid);
+
+	struct freeze_stats
+	{
+		std::size_t threads = 0;
+		// from the first PTRACE_INTERRUPT until every thread was seen stopped
+		std::chrono::nanoseconds freeze_time{ 0 };
+		// between the first and the last thread seen stopped
+		std::chrono::nanoseconds skew{ 0 };
+	};
+
+	// Every thread of a process, attached with PTRACE_SEIZE. Stop interrupts all
+	// running threads before it waits for any of them and then reaps the stops as
+	// they arrive, so freezing the process takes as long as its slowest thread
+	// rather than the sum over its threads. Threads created since the last Stop
+	// are seized by the next one, exited threads are dropped.
+	//
+	// A following group traces clone, fork and exec instead: new threads are
+	// attached by the kernel as they start, forked children are kept stopped
+	// until taken by TakeForked, and an exec is reported by TakeExec. A thread
+	// stays in its event stop until the next Stop or Poll collects it.
+	class ThreadGroup
+	{
+	public:
+		// The leader may already be seized, and stopped, by attach_python; the
+		// other threads are seized and keep running. Following needs a stopped
+		// leader if it is seized already.
+		ThreadGroup(pid_t pid, bool leader_seized, bool leader_stopped, bool follow = false);
+		// Detaches, errors are ignored.
+		~ThreadGroup();
+		ThreadGroup(const ThreadGroup& other) = delete;
+		ThreadGroup& operator=(const ThreadGroup& other) = delete;
+
+		const freeze_stats& Stop();
+		// Threads in a group-stop of job control stay stopped.
+		void Resume();
+		// Handle the signal and event stops of the running threads without
+		// waiting, so none of them sits stopped until the next Stop. Call it
+		// between Stop and the next one.
+		void Poll();
+		// Release every thread, and the forked children not taken, leaving them running.
+		void Detach();
+
+		// Children forked since the last call, seized and stopped with the same
+		// options. The caller owns them from now on.
+		std::vector<pid_t> TakeForked();
+		// Whether the process exec'd since the last call.
+		bool TakeExec();
+
+		inline pid_t pid() const
+		{
+			return pid_;
+		}
+
+		inline bool following() const
+		{
+			return follow_;
+		}
+
+		inline std::size_t size() const
+		{
+			return threads_.size();
+		}
+
+		// Of the last Stop.
+		inline const freeze_stats& stats() const
+		{
+			return stats_;
+		}
+
+	private:
+		struct thread_state
+		{
+			pid_t tid;
+			bool stopped;
+			// in a group-stop, e.g. by a SIGSTOP of the user, Resume keeps it
+			// stopped with PTRACE_LISTEN
+			bool group_stopped;
+		};
+
+		pid_t pid_;
+		bool follow_;
+		bool exec_ = false;
+		// sorted by tid
+		std::vector<thread_state> threads_;
+		// cloned during a Stop, added once it is done
+		std::vector<thread_state> born_;
+		std::vector<pid_t> forked_;
+		freeze_stats stats_;
+
+		void SeizeNew();
+		const freeze_stats& StopSeized();
+		bool ReapStop(pid_t& tid, bool* group_stop = nullptr);
+		bool WaitPending(const std::vector<std::size_t>& pending) const;
+		void OnEvent(pid_t tid, int event);
+	};
+}
@@ -0,0 +1,203 @@
+#include <algorithm>
+#include <cerrno>
+#include <limits>
+
+#include <python2.7/Python.h>
+
+#include <code_cache.h>
+
+namespace spiritsaway::cpy_frame
+{
+	// far above what the compiler emits, a larger co_lnotab is garbage
+	static const Py_ssize_t max_lnotab_size = 1 << 20;
+
+	// Python uses a compressed table data structure to store line numbers. See:
+	//
+	// https://svn.python.org/projects/python/trunk/Objects/lnotab_notes.txt
+	//
+	// The table is a list of (address increment, line increment) byte pairs. Each
+	// pair is turned into an absolute row here, rows with the same address are
+	// collapsed into the last one, which is the one PyCode_Addr2Line stops at.
+	void code_info::SetLineTable(const uint8_t* lnotab, std::size_t size)
+	{
+		lines.clear();
+		lines.reserve(size / 2 + 1);
+		lines.push_back({ 0, firstlineno });
+		int addr = 0;
+		int line = firstlineno;
+		for (std::size_t i = 0; i + 1 < size; i += 2)
+		{
+			addr += lnotab[i];
+			line += lnotab[i + 1];
+			if (lines.back().addr == addr)
+			{
+				lines.back().line = line;
+			}
+			else
+			{
+				lines.push_back({ addr, line });
+			}
+		}
+		lines.shrink_to_fit();
+	}
+
+	std::size_t code_info::Line(int f_lasti) const
+	{
+		// the last row whose addr is not past f_lasti
+		auto iter = std::upper_bound(lines.begin(), lines.end(), f_lasti,
+			[](int lasti, const line_entry& entry) { return lasti < entry.addr; });
+		if (iter == lines.begin())
+		{
+			return static_cast<std::size_t>(firstlineno);
+		}
+		return static_cast<std::size_t>((iter - 1)->line);
+	}
+
+	CodeCache::CodeCache(void* code_type_addr, void* string_type_addr, std::size_t capacity)
+		: code_type_addr_(code_type_addr),
+		string_type_addr_(string_type_addr),
+		capacity_(capacity == 0 ? 1 : capacity),
+		hits_(0),
+		misses_(0),
+		evictions_(0),
+		strings_(string_type_addr)
+	{
+	}
+
+	void code_header::Chunks(void* f_code, code_header& header, remote_chunk* chunks)
+	{
+		chunks[0] = { f_code + offsetof(PyCodeObject, ob_type), &header.ob_type, sizeof(header.ob_type) };
+		chunks[1] = { f_code + offsetof(PyCodeObject, co_filename), &header.co_filename, sizeof(header.co_filename) };
+	}
+
+	const code_info* CodeCache::Get(RemoteMemory& mem, void* f_code)
+	{
+		const auto code = TryGet(mem, f_code);
+		if (!code)
+		{
+			throw_read_error(mem.pid(), code.error());
+		}
+		return *code;
+	}
+
+	read_result<const code_info*> CodeCache::TryGet(RemoteMemory& mem, void* f_code)
+	{
+		code_header header;
+		remote_chunk chunks[2];
+		code_header::Chunks(f_code, header, chunks);
+		const auto read = mem.TryReadV(chunks, 2);
+		if (!read)
+		{
+			return tl::make_unexpected(read.error());
+		}
+		return TryGet(mem, f_code, header);
+	}
+
+	read_result<const code_info*> CodeCache::TryGet(RemoteMemory& mem, void* f_code, const code_header& header)
+	{
+		if (code_type_addr_ && header.ob_type != code_type_addr_)
+		{
+			return nullptr;
+		}
+
+		auto iter = index_.find(f_code);
+		if (iter != index_.end())
+		{
+			if (iter->second->second.co_filename == header.co_filename)
+			{
+				hits_++;
+				entries_.splice(entries_.begin(), entries_, iter->second);
+				return &iter->second->second;
+			}
+			// the address now holds another code object
+			entries_.erase(iter->second);
+			index_.erase(iter);
+		}
+
+		misses_++;
+		PyCodeObject snapshot;
+		const auto read = mem.TryRead(f_code, &snapshot, sizeof(snapshot));
+		if (!read)
+		{
+			return tl::make_unexpected(read.error());
+		}
+		auto info = Load(mem, &snapshot);
+		if (!info)
+		{
+			return tl::make_unexpected(info.error());
+		}
+		if (index_.size() >= capacity_)
+		{
+			index_.erase(entries_.back().first);
+			entries_.pop_back();
+			evictions_++;
+		}
+		entries_.emplace_front(f_code, std::move(*info));
+		index_[f_code] = entries_.begin();
+		return &entries_.front().second;
+	}
+
+	void CodeCache::Clear()
+	{
+		entries_.clear();
+		index_.clear();
+	}
+
+	void CodeCache::Retarget(void* code_type_addr, void* string_type_addr)
+	{
+		Clear();
+		code_type_addr_ = code_type_addr;
+		string_type_addr_ = string_type_addr;
+		strings_.Retarget(string_type_addr);
+	}
+
+	read_result<code_info> CodeCache::Load(RemoteMemory& mem, const void* snapshot)
+	{
+		const PyCodeObject* code = reinterpret_cast<const PyCodeObject*>(snapshot);
+		void* co_filename = code->co_filename;
+		void* co_name = code->co_name;
+		void* co_lnotab = code->co_lnotab;
+
+		code_info info;
+		info.co_filename = co_filename;
+		// code objects of one module share their co_filename object, the string
+		// table reads it only once
+		const auto file_id = strings_.TryGet(mem, co_filename);
+		if (!file_id)
+		{
+			return tl::make_unexpected(file_id.error());
+		}
+		const auto name_id = strings_.TryGet(mem, co_name);
+		if (!name_id)
+		{
+			return tl::make_unexpected(name_id.error());
+		}
+		info.file_id = *file_id;
+		info.name_id = *name_id;
+		info.firstlineno = code->co_firstlineno & std::numeric_limits<int>::max();
+
+		void* type = nullptr;
+		Py_ssize_t size = 0;
+		remote_chunk header[] = {
+			{ co_lnotab + offsetof(PyStringObject, ob_type), &type, sizeof(type) },
+			{ co_lnotab + offsetof(PyStringObject, ob_size), &size, sizeof(size) },
+		};
+		auto read = mem.TryReadV(header, sizeof(header) / sizeof(header[0]));
+		if (!read)
+		{
+			return tl::make_unexpected(read.error());
+		}
+		if ((string_type_addr_ && type != string_type_addr_) || size < 0 || size > max_lnotab_size)
+		{
+			return read_failure(EINVAL, co_lnotab);
+		}
+		std::vector<uint8_t> lnotab(size);
+		read = mem.TryRead(co_lnotab + offsetof(PyStringObject, ob_sval), lnotab.data(), size);
+		if (!read)
+		{
+			return tl::make_unexpected(read.error());
+		}
+		info.SetLineTable(lnotab.data(), lnotab.size());
+		return info;
+	}
+}
@@ -1 +1,137 @@
-#include <cpp_frame.h>
\ No newline at end of file
+#include <cxxabi.h>
+
+#include <algorithm>
+#include <cstdlib>
+#include <iostream>
+#include <sstream>
+
+#include <cpp_frame.h>
+#include <custom_exceptions.h>
+
+namespace spiritsaway::cpy_frame
+{
+	NativeSymbolizer::NativeSymbolizer(pid_t pid)
+		: pid_(pid),
+		ns_(std::make_unique<Namespace>(pid)),
+		maps_(pid)
+	{
+		Refresh();
+	}
+
+	NativeSymbolizer::~NativeSymbolizer() = default;
+
+	void NativeSymbolizer::Refresh()
+	{
+		if (!maps_.Refresh() && !modules_.empty())
+		{
+			return;
+		}
+		std::vector<module> new_modules;
+		for (const auto& one_mapping : maps_.mappings())
+		{
+			if (one_mapping.executable && !one_mapping.path.empty() && one_mapping.path[0] == '/')
+			{
+				new_modules.push_back({ one_mapping.start, one_mapping.end, one_mapping.offset, one_mapping.path,
+					names_.Intern(one_mapping.path), nullptr, false });
+			}
+		}
+		// keep the loaded ELF of every module that did not move
+		bool dropped = false;
+		for (auto& old_module : modules_)
+		{
+			auto iter = std::lower_bound(new_modules.begin(), new_modules.end(), old_module.start,
+				[](const module& a, std::uintptr_t start) { return a.start < start; });
+			if (iter != new_modules.end() && iter->start == old_module.start && iter->end == old_module.end &&
+				iter->offset == old_module.offset && iter->path == old_module.path)
+			{
+				iter->elf = std::move(old_module.elf);
+				iter->loaded = old_module.loaded;
+			}
+			else if (old_module.elf)
+			{
+				dropped = true;
+			}
+		}
+		modules_ = std::move(new_modules);
+		if (dropped)
+		{
+			// the mangled names of unmapped modules are dangling keys now, the
+			// demangled strings stay in names_
+			demangled_.clear();
+		}
+	}
+
+	ELF* NativeSymbolizer::Load(module& one_module)
+	{
+		if (!one_module.loaded)
+		{
+			one_module.loaded = true;
+			try
+			{
+				// several mappings may share one file, open it once
+				for (const auto& other : modules_)
+				{
+					if (other.elf && other.path == one_module.path)
+					{
+						one_module.elf = other.elf;
+						break;
+					}
+				}
+				if (!one_module.elf)
+				{
+					one_module.elf = std::make_shared<ELF>();
+					one_module.elf->Open(one_module.path, ns_.get());
+					one_module.elf->Parse();
+				}
+			}
+			catch (const FatalException& e)
+			{
+				std::cerr << "Failed to load symbols of " << one_module.path << ": " << e.what() << std::endl;
+				one_module.elf.reset();
+			}
+		}
+		return one_module.elf.get();
+	}
+
+	std::string_view NativeSymbolizer::Demangle(const char* name)
+	{
+		auto iter = demangled_.find(name);
+		if (iter == demangled_.end())
+		{
+			int status = 0;
+			char* demangled = abi::__cxa_demangle(name, nullptr, nullptr, &status);
+			iter = demangled_.emplace(name, names_.Intern(status == 0 && demangled ? demangled : name)).first;
+			std::free(demangled);
+		}
+		return names_.Str(iter->second);
+	}
+
+	native_frame NativeSymbolizer::Symbolize(void* ip)
+	{
+		native_frame frame{ ip, {}, {}, 0 };
+		const auto addr = reinterpret_cast<std::uintptr_t>(ip);
+		auto iter = std::upper_bound(modules_.begin(), modules_.end(), addr,
+			[](std::uintptr_t value, const module& one_module) { return value < one_module.start; });
+		if (iter == modules_.begin() || addr >= (--iter)->end)
+		{
+			return frame;
+		}
+		module& one_module = *iter;
+		const std::size_t file_offset = addr - one_module.start + one_module.offset;
+		frame.module = names_.Str(one_module.path_id);
+		frame.offset = file_offset;
+
+		ELF* elf = Load(one_module);
+		addr_t vaddr = 0;
+		if (elf == nullptr || !elf->FileOffsetToVaddr(file_offset, vaddr))
+		{
+			return frame;
+		}
+		if (const elf_symbol* sym = elf->FindSymbolByAddress(vaddr))
+		{
+			frame.name = Demangle(sym->name);
+			frame.offset = vaddr - sym->addr;
+		}
+		return frame;
+	}
+}
@@ -7,19 +7,50 @@
 #include <unistd.h>
 #include <sys/mman.h>
 
+#include <algorithm>
 #include <cstring>
 #include <iostream>
 #include <sstream>
 
 #include <elf_utils.h>
+#include <symbol_cache.h>
 
 #include <custom_exceptions.h>
 
 namespace spiritsaway::cpy_frame
 {
+	// The hash function of DT_GNU_HASH tables
+	static uint32_t gnu_hash(const char* name)
+	{
+		uint32_t h = 5381;
+		for (auto c = reinterpret_cast<const unsigned char*>(name); *c; c++)
+		{
+			h = h * 33 + *c;
+		}
+		return h;
+	}
 
+	// The hash function of SysV DT_HASH tables
+	static uint32_t sysv_hash(const char* name)
+	{
+		uint32_t h = 0;
+		for (auto c = reinterpret_cast<const unsigned char*>(name); *c; c++)
+		{
+			h = (h << 4) + *c;
+			const uint32_t g = h & 0xf0000000;
+			if (g)
+			{
+				h ^= g >> 24;
+			}
+			h &= ~g;
+		}
+		return h;
+	}
 
-
+	static bool is_defined(const sym_t* sym)
+	{
+		return sym->st_shndx != SHN_UNDEF;
+	}
 
 	void ELF::Close()
 	{
@@ -28,12 +59,24 @@ namespace spiritsaway::cpy_frame
 			munmap(addr_, length_);
 			addr_ = nullptr;
 		}
+		symtab_index_.clear();
+		symtab_buckets_.clear();
+		symtab_indexed_ = false;
+		addr_index_.clear();
+		addr_indexed_ = false;
+		parsed_ = false;
+		dynamic_ = dynstr_ = dynsym_ = strtab_ = symtab_ = gnu_hash_ = hash_ = debuglink_ = -1;
+		stat_key_.clear();
+		debug_.reset();
+		debug_searched_ = false;
 	}
 
 	// mmap the file
 	void ELF::Open(const std::string& target, Namespace* ns)
 	{
 		Close();
+		path_ = target;
+		ns_ = ns;
 		int fd;
 		if (ns != nullptr)
 		{
@@ -49,6 +92,14 @@ namespace spiritsaway::cpy_frame
 			ss << "Failed to open ELF file " << target << ": " << strerror(errno);
 			throw FatalException(ss.str());
 		}
+		struct stat st;
+		if (fstat(fd, &st) == 0)
+		{
+			std::ostringstream key;
+			key << "stat-" << std::hex << st.st_dev << '-' << st.st_ino << '-' << st.st_size << '-'
+				<< st.st_mtim.tv_sec << '.' << st.st_mtim.tv_nsec;
+			stat_key_ = key.str();
+		}
 		length_ = lseek(fd, 0, SEEK_END);
 		addr_ = mmap(nullptr, length_, PROT_READ, MAP_SHARED, fd, 0);
 		cpy_frame::Close(fd);
@@ -79,6 +130,28 @@ namespace spiritsaway::cpy_frame
 	}
 
 	void ELF::Parse()
+	{
+		if (parsed_)
+		{
+			return;
+		}
+		ParseSections();
+		if (dynamic_ == -1)
+		{
+			throw FatalException("Failed to find section .dynamic");
+		}
+		else if (dynstr_ == -1)
+		{
+			throw FatalException("Failed to find section .dynstr");
+		}
+		else if (dynsym_ == -1)
+		{
+			throw FatalException("Failed to find section .dynsym");
+		}
+		parsed_ = true;
+	}
+
+	void ELF::ParseSections()
 	{
 		// skip the first section since it must be of type SHT_NULL
 		for (uint16_t i = 1; i < hdr()->e_shnum; i++)
@@ -105,29 +178,138 @@ namespace spiritsaway::cpy_frame
 			case SHT_SYMTAB:
 				symtab_ = i;
 				break;
+			case SHT_GNU_HASH:
+				gnu_hash_ = i;
+				break;
+			case SHT_HASH:
+				hash_ = i;
+				break;
+			case SHT_PROGBITS:
+				if (strcmp(strtab(s->sh_name), ".gnu_debuglink") == 0)
+				{
+					debuglink_ = i;
+				}
+				break;
 			}
 		}
-		if (dynamic_ == -1)
+	}
+
+	// Where gdb looks for separate debug files by default
+	static const char* const debug_file_dir = "/usr/lib/debug";
+
+	ELF* ELF::DebugFile()
+	{
+		if (debug_searched_)
 		{
-			throw FatalException("Failed to find section .dynamic");
+			return debug_.get();
 		}
-		else if (dynstr_ == -1)
+		debug_searched_ = true;
+		std::vector<std::string> candidates;
+		const std::string build_id = BuildId();
+		if (build_id.size() > 2)
 		{
-			throw FatalException("Failed to find section .dynstr");
+			candidates.push_back(std::string(debug_file_dir) + "/.build-id/" + build_id.substr(0, 2) + "/" +
+				build_id.substr(2) + ".debug");
 		}
-		else if (dynsym_ == -1)
+		if (debuglink_ >= 0)
 		{
-			throw FatalException("Failed to find section .dynsym");
+			// a NUL terminated file name, padded to 4 bytes, followed by a CRC32
+			const shdr_t* s = shdr(debuglink_);
+			const char* link = reinterpret_cast<const char*>(p() + s->sh_offset);
+			const std::string name(link, strnlen(link, s->sh_size));
+			const auto slash = path_.rfind('/');
+			const std::string dir = slash == std::string::npos ? std::string(".") : path_.substr(0, slash);
+			if (!name.empty())
+			{
+				candidates.push_back(dir + "/" + name);
+				candidates.push_back(dir + "/.debug/" + name);
+				candidates.push_back(debug_file_dir + dir + "/" + name);
+			}
+		}
+		for (const auto& candidate : candidates)
+		{
+			if (candidate == path_)
+			{
+				continue;
+			}
+			auto debug = std::make_unique<ELF>();
+			try
+			{
+				debug->Open(candidate, ns_);
+			}
+			catch (const FatalException&)
+			{
+				continue;
+			}
+			// checking the build-id is much cheaper than the CRC of the whole file
+			if (!build_id.empty() && debug->BuildId() != build_id)
+			{
+				continue;
+			}
+			debug->ParseSections();
+			if (debug->symtab_ < 0 || debug->strtab_ < 0)
+			{
+				continue;
+			}
+			debug_ = std::move(debug);
+			break;
 		}
+		return debug_.get();
+	}
+
+	std::string ELF::BuildId() const
+	{
+		for (int i = 0; i < hdr()->e_phnum; i++)
+		{
+			const phdr_t* ph = phdr(i);
+			if (ph->p_type != PT_NOTE || ph->p_offset + ph->p_filesz > length_)
+			{
+				continue;
+			}
+			// notes of a PT_NOTE segment are padded to its alignment, 4 or 8
+			const size_t align = ph->p_align == 8 ? 8 : 4;
+			auto pad = [align](size_t n) { return (n + align - 1) & ~(align - 1); };
+			size_t offset = 0;
+			while (offset + sizeof(Elf64_Nhdr) <= ph->p_filesz)
+			{
+				const auto* note = reinterpret_cast<const Elf64_Nhdr*>(p() + ph->p_offset + offset);
+				const char* name = reinterpret_cast<const char*>(note + 1);
+				const auto* desc = reinterpret_cast<const unsigned char*>(name + pad(note->n_namesz));
+				const size_t next = offset + sizeof(Elf64_Nhdr) + pad(note->n_namesz) + pad(note->n_descsz);
+				if (next > ph->p_filesz)
+				{
+					break;
+				}
+				if (note->n_type == NT_GNU_BUILD_ID && note->n_namesz == 4 && memcmp(name, "GNU", 4) == 0)
+				{
+					std::ostringstream ss;
+					ss << std::hex;
+					for (size_t j = 0; j < note->n_descsz; j++)
+					{
+						ss << (desc[j] >> 4) << (desc[j] & 0xf);
+					}
+					return ss.str();
+				}
+				offset = next;
+			}
+		}
+		return std::string();
+	}
+
+	std::string ELF::CacheKey() const
+	{
+		const std::string build_id = BuildId();
+		return build_id.empty() ? stat_key_ : "buildid-" + build_id;
 	}
 
 	std::vector<std::string> ELF::NeededLibs()
 	{
+		Parse();
 		// Get all of the strings
 		std::vector<std::string> needed;
 		const shdr_t* s = shdr(dynamic_);
 		const shdr_t* d = shdr(dynstr_);
-		for (uint16_t i = 0; i < s->sh_size / s->sh_entsize; i++)
+		for (size_t i = 0; i < s->sh_size / s->sh_entsize; i++)
 		{
 			const dyn_t* dyn =
 				reinterpret_cast<const dyn_t*>(p() + s->sh_offset + i * s->sh_entsize);
@@ -140,63 +322,267 @@ namespace spiritsaway::cpy_frame
 		return needed;
 	}
 
-	PyABI ELF::WalkTable(int sym, int str, PyAddresses* addrs)
+	const sym_t* ELF::FindGnuHash(const char* name) const
 	{
-		PyABI abi{};
-		bool have_abi = false;
-		const shdr_t* s = shdr(sym);
-		const shdr_t* d = shdr(str);
-		for (uint16_t i = 0; i < s->sh_size / s->sh_entsize; i++)
+		// nbuckets, symoffset, bloom_size, bloom_shift, bloom[bloom_size],
+		// buckets[nbuckets], chain[]
+		const shdr_t* s = shdr(gnu_hash_);
+		const uint32_t* header = reinterpret_cast<const uint32_t*>(p() + s->sh_offset);
+		const uint32_t nbuckets = header[0];
+		const uint32_t symoffset = header[1];
+		const uint32_t bloom_size = header[2];
+		const uint32_t bloom_shift = header[3];
+		if (nbuckets == 0 || bloom_size == 0)
+		{
+			return nullptr;
+		}
+		const addr_t* bloom = reinterpret_cast<const addr_t*>(header + 4);
+		const uint32_t* buckets = reinterpret_cast<const uint32_t*>(bloom + bloom_size);
+		const uint32_t* chain = buckets + nbuckets;
+
+		const uint32_t h = gnu_hash(name);
+		constexpr uint32_t word_bits = sizeof(addr_t) * CHAR_BIT;
+		const addr_t word = bloom[(h / word_bits) % bloom_size];
+		const addr_t mask = (addr_t(1) << (h % word_bits)) | (addr_t(1) << ((h >> bloom_shift) % word_bits));
+		if ((word & mask) != mask)
+		{
+			return nullptr;
+		}
+		uint32_t idx = buckets[h % nbuckets];
+		if (idx < symoffset)
 		{
-			if (have_abi && addrs->tstate_addr && addrs->interp_head_addr &&
-				addrs->interp_head_fn_addr)
+			return nullptr;
+		}
+		for (;; idx++)
+		{
+			// the lowest bit of a chain entry marks the end of the bucket
+			const uint32_t chain_hash = chain[idx - symoffset];
+			if ((h | 1) == (chain_hash | 1))
 			{
-				break;
+				const sym_t* sym = symbol(dynsym_, idx);
+				if (is_defined(sym) && strcmp(symbol_name(dynstr_, sym), name) == 0)
+				{
+					return sym;
+				}
 			}
-
-			const sym_t* sym =
-				reinterpret_cast<const sym_t*>(p() + s->sh_offset + i * s->sh_entsize);
-			const char* name =
-				reinterpret_cast<const char*>(p() + d->sh_offset + sym->st_name);
-			if (!addrs->tstate_addr && strcmp(name, "_PyThreadState_Current") == 0)
+			if (chain_hash & 1)
 			{
-				addrs->tstate_addr = reinterpret_cast<void*>(sym->st_value);
+				return nullptr;
 			}
-			else if (!addrs->interp_head_addr && strcmp(name, "interp_head") == 0)
+		}
+	}
+
+	const sym_t* ELF::FindSysvHash(const char* name) const
+	{
+		// nbucket, nchain, bucket[nbucket], chain[nchain]
+		const shdr_t* s = shdr(hash_);
+		const uint32_t* header = reinterpret_cast<const uint32_t*>(p() + s->sh_offset);
+		const uint32_t nbucket = header[0];
+		const uint32_t nchain = header[1];
+		if (nbucket == 0)
+		{
+			return nullptr;
+		}
+		const uint32_t* bucket = header + 2;
+		const uint32_t* chain = bucket + nbucket;
+		for (uint32_t idx = bucket[sysv_hash(name) % nbucket]; idx != STN_UNDEF && idx < nchain; idx = chain[idx])
+		{
+			const sym_t* sym = symbol(dynsym_, idx);
+			if (is_defined(sym) && strcmp(symbol_name(dynstr_, sym), name) == 0)
 			{
-				addrs->interp_head_addr = reinterpret_cast<void*>(sym->st_value);
+				return sym;
 			}
-			else if (!addrs->interp_head_addr &&
-				strcmp(name, "PyInterpreterState_Head") == 0)
+		}
+		return nullptr;
+	}
+
+	const sym_t* ELF::FindSymtab(const char* name)
+	{
+		if (symtab_ < 0 || strtab_ < 0)
+		{
+			// stripped, try the separate debug file
+			ELF* debug = DebugFile();
+			return debug ? debug->FindSymtab(name) : nullptr;
+		}
+		if (!symtab_indexed_)
+		{
+			// counting sort of the symbols by hash bucket, so a bucket is one
+			// contiguous range of symtab_index_
+			const size_t n = symbol_count(symtab_);
+			std::vector<uint32_t> hashes(n);
+			size_t buckets = 1;
+			while (buckets < n / 2)
 			{
-				addrs->interp_head_fn_addr = reinterpret_cast<void*>(sym->st_value);
+				buckets <<= 1;
 			}
-			else if (!have_abi)
+			symtab_buckets_.assign(buckets + 1, 0);
+			for (size_t i = 1; i < n; i++)
 			{
-				if (strcmp(name, "PyString_Type") == 0)
+				const sym_t* sym = symbol(symtab_, i);
+				if (is_defined(sym) && sym->st_name)
 				{
-					// If we find PyString_Type, this is some kind of Python 2.
-					have_abi = true;
-					abi = PyABI::Py26;
+					hashes[i] = gnu_hash(symbol_name(strtab_, sym));
+					symtab_buckets_[(hashes[i] & (buckets - 1)) + 1]++;
 				}
-				else if (strcmp(name, "PyBytes_Type") == 0)
+			}
+			for (size_t i = 1; i <= buckets; i++)
+			{
+				symtab_buckets_[i] += symtab_buckets_[i - 1];
+			}
+			symtab_index_.resize(symtab_buckets_[buckets]);
+			std::vector<uint32_t> fill(symtab_buckets_.begin(), symtab_buckets_.end() - 1);
+			for (size_t i = 1; i < n; i++)
+			{
+				const sym_t* sym = symbol(symtab_, i);
+				if (is_defined(sym) && sym->st_name)
 				{
-					// If we find PyBytes_Type, it's Python 3. Continue looping though, in
-					// case we see a Python 3.6 symbol.
-					abi = PyABI::Py34;
+					symtab_index_[fill[hashes[i] & (buckets - 1)]++] = { hashes[i], static_cast<uint32_t>(i) };
 				}
-				else if (strcmp(name, "_PyEval_RequestCodeExtraIndex") == 0 ||
-					strcmp(name, "_PyCode_GetExtra") == 0 ||
-					strcmp(name, "_PyCode_SetExtra") == 0)
+			}
+			symtab_indexed_ = true;
+		}
+		const uint32_t h = gnu_hash(name);
+		const size_t bucket = h & (symtab_buckets_.size() - 2);
+		for (uint32_t i = symtab_buckets_[bucket]; i < symtab_buckets_[bucket + 1]; i++)
+		{
+			if (symtab_index_[i].first != h)
+			{
+				continue;
+			}
+			const sym_t* sym = symbol(symtab_, symtab_index_[i].second);
+			if (strcmp(symbol_name(strtab_, sym), name) == 0)
+			{
+				return sym;
+			}
+		}
+		return nullptr;
+	}
+
+	const sym_t* ELF::FindSymbol(const char* name)
+	{
+		Parse();
+		const sym_t* sym = nullptr;
+		if (gnu_hash_ >= 0 && static_cast<int>(shdr(gnu_hash_)->sh_link) == dynsym_)
+		{
+			sym = FindGnuHash(name);
+		}
+		else if (hash_ >= 0 && static_cast<int>(shdr(hash_)->sh_link) == dynsym_)
+		{
+			sym = FindSysvHash(name);
+		}
+		if (sym == nullptr)
+		{
+			// static symbols such as interp_head only live in .symtab
+			sym = FindSymtab(name);
+		}
+		return sym;
+	}
+
+	void ELF::IndexFunctions(int sym, int str, std::vector<elf_symbol>& index) const
+	{
+		const size_t n = symbol_count(sym);
+		for (size_t i = 1; i < n; i++)
+		{
+			const sym_t* one_sym = symbol(sym, i);
+			const int type = ELF64_ST_TYPE(one_sym->st_info);
+			if ((type == STT_FUNC || type == STT_GNU_IFUNC) && is_defined(one_sym) && one_sym->st_value)
+			{
+				index.push_back({ one_sym->st_value, one_sym->st_size, symbol_name(str, one_sym) });
+			}
+		}
+	}
+
+	const elf_symbol* ELF::FindSymbolByAddress(addr_t vaddr)
+	{
+		Parse();
+		if (!addr_indexed_)
+		{
+			if (symtab_ >= 0 && strtab_ >= 0)
+			{
+				IndexFunctions(symtab_, strtab_, addr_index_);
+			}
+			else if (ELF* debug = DebugFile())
+			{
+				debug->IndexFunctions(debug->symtab_, debug->strtab_, addr_index_);
+			}
+			IndexFunctions(dynsym_, dynstr_, addr_index_);
+			// stable, so for aliases the .symtab name wins over the .dynsym one
+			std::stable_sort(addr_index_.begin(), addr_index_.end(),
+				[](const elf_symbol& a, const elf_symbol& b) { return a.addr < b.addr; });
+			addr_index_.erase(std::unique(addr_index_.begin(), addr_index_.end(),
+				[](const elf_symbol& a, const elf_symbol& b) { return a.addr == b.addr; }),
+				addr_index_.end());
+			addr_index_.shrink_to_fit();
+			addr_indexed_ = true;
+		}
+		auto iter = std::upper_bound(addr_index_.begin(), addr_index_.end(), vaddr,
+			[](addr_t value, const elf_symbol& sym) { return value < sym.addr; });
+		if (iter == addr_index_.begin())
+		{
+			return nullptr;
+		}
+		--iter;
+		if (iter->size && vaddr >= iter->addr + iter->size)
+		{
+			return nullptr;
+		}
+		return &*iter;
+	}
+
+	bool ELF::FileOffsetToVaddr(size_t file_offset, addr_t& vaddr) const
+	{
+		for (int i = 0; i < hdr()->e_phnum; i++)
+		{
+			const phdr_t* ph = phdr(i);
+			if (ph->p_type == PT_LOAD && file_offset >= ph->p_offset &&
+				file_offset < ph->p_offset + ph->p_filesz)
+			{
+				vaddr = ph->p_vaddr + (file_offset - ph->p_offset);
+				return true;
+			}
+		}
+		return false;
+	}
+
+	bool ELF::IsExecutable(addr_t vaddr) const
+	{
+		for (int i = 0; i < hdr()->e_phnum; i++)
+		{
+			const phdr_t* ph = phdr(i);
+			if (ph->p_type == PT_LOAD && (ph->p_flags & PF_X) && vaddr >= ph->p_vaddr &&
+				vaddr < ph->p_vaddr + ph->p_memsz)
+			{
+				return true;
+			}
+		}
+		return false;
+	}
+
+	std::vector<std::pair<addr_t, addr_t>> ELF::DataRanges()
+	{
+		Parse();
+		std::vector<std::pair<addr_t, addr_t>> ranges;
+		for (uint16_t i = 1; i < hdr()->e_shnum; i++)
+		{
+			const shdr_t* s = shdr(i);
+			if ((s->sh_flags & SHF_ALLOC) && (s->sh_flags & SHF_WRITE) && s->sh_size &&
+				(strcmp(strtab(s->sh_name), ".data") == 0 || strcmp(strtab(s->sh_name), ".bss") == 0))
+			{
+				ranges.emplace_back(s->sh_addr, s->sh_addr + s->sh_size);
+			}
+		}
+		if (ranges.empty())
+		{
+			for (int i = 0; i < hdr()->e_phnum; i++)
+			{
+				const phdr_t* ph = phdr(i);
+				if (ph->p_type == PT_LOAD && (ph->p_flags & PF_W) && ph->p_memsz)
 				{
-					// Symbols added for Python 3.6, see:
-					// https://www.python.org/dev/peps/pep-0523/
-					have_abi = true;
-					abi = PyABI::Py36;
+					ranges.emplace_back(ph->p_vaddr, ph->p_vaddr + ph->p_memsz);
 				}
 			}
 		}
-		return abi;
+		return ranges;
 	}
 
 	addr_t ELF::GetBaseAddress()
@@ -214,12 +600,87 @@ namespace spiritsaway::cpy_frame
 	}
 
 	PyAddresses ELF::GetAddresses(PyABI* abi)
+	{
+		const std::string key = CacheKey();
+		PyAddresses addrs;
+		PyABI detected_abi;
+		if (key.empty())
+		{
+			addrs = LookupAddresses(&detected_abi);
+		}
+		else if (!SymbolCache::LoadShared(key, addrs, detected_abi))
+		{
+			const SymbolCache* cache = SymbolCache::Default();
+			if (!cache || !cache->Load(key, addrs, detected_abi) || !TrustCached(addrs))
+			{
+				addrs = LookupAddresses(&detected_abi);
+				if (cache)
+				{
+					cache->Store(key, addrs, detected_abi);
+				}
+			}
+			SymbolCache::StoreShared(key, addrs, detected_abi);
+		}
+		if (abi != nullptr)
+		{
+			*abi = detected_abi;
+		}
+		return addrs;
+	}
+
+	bool ELF::TrustCached(const PyAddresses& addrs)
+	{
+		// interp_head_fn_addr gets called in the target, an entry that does not
+		// point it at code of this file is not trusted
+		if (addrs.interp_head_fn_addr && !IsExecutable(reinterpret_cast<addr_t>(addrs.interp_head_fn_addr) +
+			(hdr()->e_type == ET_DYN ? GetBaseAddress() : 0)))
+		{
+			return false;
+		}
+		// a stripped file may have got its debug file installed since the entry
+		// was written
+		if (!addrs.interp_head_addr)
+		{
+			Parse();
+			if ((symtab_ < 0 || strtab_ < 0) && DebugFile() != nullptr)
+			{
+				return false;
+			}
+		}
+		return true;
+	}
+
+	PyAddresses ELF::LookupAddresses(PyABI* abi)
 	{
 		PyAddresses addrs;
-		PyABI detected_abi = WalkTable(dynsym_, dynstr_, &addrs);
-		if (symtab_ >= 0 && strtab_ >= 0)
+		auto find = [this](const char* name) -> void*
+		{
+			const sym_t* sym = FindSymbol(name);
+			return sym ? reinterpret_cast<void*>(sym->st_value) : nullptr;
+		};
+		addrs.tstate_addr = find("_PyThreadState_Current");
+		addrs.interp_head_addr = find("interp_head");
+		addrs.interp_head_fn_addr = find("PyInterpreterState_Head");
+		addrs.frame_type_addr = find("PyFrame_Type");
+		addrs.code_type_addr = find("PyCode_Type");
+		addrs.string_type_addr = find("PyString_Type");
+
+		PyABI detected_abi = PyABI::Unknown;
+		if (addrs.string_type_addr)
+		{
+			// If we find PyString_Type, this is some kind of Python 2.
+			detected_abi = PyABI::Py26;
+		}
+		else if (find("_PyEval_RequestCodeExtraIndex") || find("_PyCode_GetExtra") ||
+			find("_PyCode_SetExtra"))
+		{
+			// Symbols added for Python 3.6, see:
+			// https://www.python.org/dev/peps/pep-0523/
+			detected_abi = PyABI::Py36;
+		}
+		else if (find("PyBytes_Type"))
 		{
-			detected_abi = WalkTable(symtab_, strtab_, &addrs);
+			detected_abi = PyABI::Py34;
 		}
 		addrs.pie = (hdr()->e_type == ET_DYN);
 		if (abi != nullptr)
@@ -0,0 +1,261 @@
+#include <python2.7/Python.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <iostream>
+#include <unordered_map>
+#include <vector>
+
+#include <custom_exceptions.h>
+#include <interp_locator.h>
+#include <symbol_cache.h>
+
+namespace spiritsaway::cpy_frame
+{
+	// more threads than this means we are following garbage
+	static const std::size_t max_interp_threads = 1 << 16;
+
+	// Interpreter and thread states are malloc'ed, so they live on the heap or in
+	// an anonymous mapping, never in a file.
+	static bool heap_pointer(const MemoryMap& maps, const void* ptr)
+	{
+		if (reinterpret_cast<std::uintptr_t>(ptr) % alignof(void*))
+		{
+			return false;
+		}
+		const mapping* one_mapping = maps.Find(ptr);
+		return one_mapping && one_mapping->readable && one_mapping->writable &&
+			(one_mapping->path.empty() || one_mapping->path == "[heap]");
+	}
+
+	static bool is_interpreter_state(RemoteMemory& mem, const MemoryMap& maps, void* candidate)
+	{
+		// most candidates are not, a failed read is just another no
+		PyInterpreterState istate;
+		if (!mem.TryRead(candidate, &istate, sizeof(istate)))
+		{
+			return false;
+		}
+		if ((istate.next && !heap_pointer(maps, istate.next)) || !heap_pointer(maps, istate.tstate_head) ||
+			!heap_pointer(maps, istate.modules) || !heap_pointer(maps, istate.sysdict) ||
+			!heap_pointer(maps, istate.builtins))
+		{
+			return false;
+		}
+		PyThreadState* tstate = istate.tstate_head;
+		for (std::size_t n = 0; tstate != nullptr; n++)
+		{
+			if (n == max_interp_threads || !heap_pointer(maps, tstate))
+			{
+				return false;
+			}
+			PyThreadState thread;
+			if (!mem.TryRead(tstate, &thread, sizeof(thread)) || thread.interp != candidate)
+			{
+				return false;
+			}
+			tstate = thread.next;
+		}
+		return true;
+	}
+
+	// Scan the data ranges, relocated by bias, for the slot of a pointer to an
+	// interpreter state. A static like autoInterpreterState in pystate.c points
+	// at the same state, so more than one matching slot is rejected: nullptr.
+	static void* scan_interp_head(RemoteMemory& mem, const MemoryMap& maps,
+		const std::vector<std::pair<addr_t, addr_t>>& ranges, std::uintptr_t bias)
+	{
+		// every heap pointer falls into [lo, lo + span)
+		std::uintptr_t lo = UINTPTR_MAX;
+		std::uintptr_t hi = 0;
+		for (const auto& one_mapping : maps.mappings())
+		{
+			if (one_mapping.readable && one_mapping.writable)
+			{
+				lo = std::min(lo, one_mapping.start);
+				hi = std::max(hi, one_mapping.end);
+			}
+		}
+		if (hi <= lo)
+		{
+			return nullptr;
+		}
+		const std::uintptr_t span = hi - lo;
+
+		std::vector<std::uintptr_t> words;
+		std::vector<std::uint8_t> plausible;
+		std::unordered_map<std::uintptr_t, bool> checked;
+		std::vector<void*> found;
+		for (const auto& range : ranges)
+		{
+			const std::uintptr_t range_start = (range.first + bias + alignof(void*) - 1) & ~(alignof(void*) - 1);
+			const std::uintptr_t range_end = range.second + bias;
+			// one bulk read per readable mapping the section overlaps
+			for (const auto& one_mapping : maps.mappings())
+			{
+				const std::uintptr_t start = std::max(range_start, one_mapping.start);
+				const std::uintptr_t end = std::min(range_end, one_mapping.end);
+				if (start >= end || !one_mapping.readable)
+				{
+					continue;
+				}
+				const std::size_t n_words = (end - start) / sizeof(std::uintptr_t);
+				words.resize(n_words);
+				plausible.resize(n_words);
+				if (!mem.TryRead(reinterpret_cast<void*>(start), words.data(), n_words * sizeof(std::uintptr_t)))
+				{
+					continue;
+				}
+				// branch free so the compiler vectorizes it, nearly every word is
+				// zero, a small integer or a pointer into the file itself
+				for (std::size_t i = 0; i < n_words; i++)
+				{
+					plausible[i] = static_cast<std::uint8_t>(((words[i] - lo) < span) &
+						((words[i] & (alignof(void*) - 1)) == 0));
+				}
+				for (std::size_t i = 0; i < n_words; i++)
+				{
+					if (!plausible[i])
+					{
+						continue;
+					}
+					void* candidate = reinterpret_cast<void*>(words[i]);
+					auto iter = checked.find(words[i]);
+					if (iter == checked.end())
+					{
+						const bool valid = heap_pointer(maps, candidate) && is_interpreter_state(mem, maps, candidate);
+						iter = checked.emplace(words[i], valid).first;
+					}
+					if (iter->second)
+					{
+						found.push_back(reinterpret_cast<void*>(start + i * sizeof(std::uintptr_t)));
+					}
+				}
+			}
+		}
+		if (found.size() > 1)
+		{
+			std::cerr << "interp_head is ambiguous, " << found.size() << " slots point at an interpreter state"
+				<< std::endl;
+		}
+		return found.size() == 1 ? found.front() : nullptr;
+	}
+
+	// PyInterpreterState_Head is exported and only returns interp_head, so on
+	// x86-64 it starts with a RIP-relative load of it: mov rax, [rip + disp32],
+	// possibly after an endbr64 or an unoptimized frame setup. Returns the
+	// remote address it loads from, 0 if the code looks different.
+	static std::uintptr_t decode_interp_head_fn(RemoteMemory& mem, void* fn_addr)
+	{
+#if defined(__x86_64__)
+		static const std::uint8_t endbr64[] = { 0xf3, 0x0f, 0x1e, 0xfa };
+		static const std::uint8_t frame_setup[] = { 0x55, 0x48, 0x89, 0xe5 };
+		static const std::uint8_t mov_rax_rip[] = { 0x48, 0x8b, 0x05 };
+		std::uint8_t code[16];
+		if (fn_addr == nullptr || !mem.TryRead(fn_addr, code, sizeof(code)))
+		{
+			return 0;
+		}
+		std::size_t pos = 0;
+		if (std::equal(std::begin(endbr64), std::end(endbr64), code + pos))
+		{
+			pos += sizeof(endbr64);
+		}
+		if (std::equal(std::begin(frame_setup), std::end(frame_setup), code + pos))
+		{
+			pos += sizeof(frame_setup);
+		}
+		if (!std::equal(std::begin(mov_rax_rip), std::end(mov_rax_rip), code + pos))
+		{
+			return 0;
+		}
+		pos += sizeof(mov_rax_rip);
+		std::int32_t disp = 0;
+		std::memcpy(&disp, code + pos, sizeof(disp));
+		pos += sizeof(disp);
+		return reinterpret_cast<std::uintptr_t>(fn_addr) + pos + disp;
+#else
+		return 0;
+#endif
+	}
+
+	void* locate_interp_head(RemoteMemory& mem, const MemoryMap& maps, const PyAddresses& addrs)
+	{
+		// the tail of .bss is an anonymous mapping right after the file's own
+		const mapping* home = nullptr;
+		for (const auto& one_mapping : maps.mappings())
+		{
+			if (one_mapping.start > reinterpret_cast<std::uintptr_t>(addrs.tstate_addr))
+			{
+				break;
+			}
+			if (!one_mapping.path.empty() && one_mapping.path[0] == '/')
+			{
+				home = &one_mapping;
+			}
+		}
+		if (home == nullptr)
+		{
+			return nullptr;
+		}
+		Namespace ns(mem.pid());
+		ELF elf;
+		std::vector<std::pair<addr_t, addr_t>> ranges;
+		std::uintptr_t bias = 0;
+		std::uintptr_t module_base = 0;
+		try
+		{
+			elf.Open(home->path, &ns);
+			ranges = elf.DataRanges();
+			// relocated like the symbols in Addrs
+			if (addrs.pie)
+			{
+				module_base = maps.ModuleBase(home->path);
+				bias = module_base - elf.GetBaseAddress();
+			}
+		}
+		catch (const FatalException& e)
+		{
+			std::cerr << "Failed to read the data sections of " << home->path << ": " << e.what() << std::endl;
+			return nullptr;
+		}
+
+		void* found = nullptr;
+		const std::uintptr_t decoded = decode_interp_head_fn(mem, addrs.interp_head_fn_addr);
+		for (const auto& range : ranges)
+		{
+			if (decoded && decoded % alignof(void*) == 0 && decoded >= range.first + bias &&
+				decoded + sizeof(void*) <= range.second + bias)
+			{
+				found = reinterpret_cast<void*>(decoded);
+			}
+		}
+		if (found == nullptr)
+		{
+			found = scan_interp_head(mem, maps, ranges, bias);
+		}
+		if (found == nullptr)
+		{
+			return nullptr;
+		}
+
+		// the caches hold the addresses before relocation
+		const std::string key = elf.CacheKey();
+		const SymbolCache* cache = SymbolCache::Default();
+		PyAddresses cached;
+		PyABI abi;
+		if (!key.empty() && (SymbolCache::LoadShared(key, cached, abi) || (cache && cache->Load(key, cached, abi))) &&
+			cached.tstate_addr == static_cast<char*>(addrs.tstate_addr) - module_base)
+		{
+			cached.interp_head_addr = static_cast<char*>(found) - module_base;
+			SymbolCache::StoreShared(key, cached, abi);
+			if (cache)
+			{
+				cache->Store(key, cached, abi);
+			}
+		}
+		return found;
+	}
+}
@@ -0,0 +1,237 @@
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+
+#include <custom_exceptions.h>
+#include <memory_map.h>
+
+namespace spiritsaway::cpy_frame
+{
+	MemoryMap::MemoryMap(pid_t pid)
+		: pid_(pid),
+		generation_(0)
+	{
+		std::ostringstream ss;
+		ss << "/proc/" << pid << "/maps";
+		path_ = ss.str();
+		Refresh();
+	}
+
+	bool MemoryMap::Refresh()
+	{
+		int fd = open(path_.c_str(), O_RDONLY);
+		if (fd == -1)
+		{
+			std::ostringstream ss;
+			ss << "Failed to open " << path_ << ": " << strerror(errno);
+			throw PtraceException(ss.str());
+		}
+		std::string content;
+		content.reserve(content_.size() + 4096);
+		char buf[16384];
+		for (;;)
+		{
+			const ssize_t n = read(fd, buf, sizeof(buf));
+			if (n > 0)
+			{
+				content.append(buf, n);
+			}
+			else if (n == 0 || errno != EINTR)
+			{
+				break;
+			}
+		}
+		close(fd);
+		if (content == content_ && generation_)
+		{
+			return false;
+		}
+		content_.swap(content);
+		Parse();
+		generation_++;
+		return true;
+	}
+
+	void MemoryMap::Parse()
+	{
+		static const char deleted_suffix[] = " (deleted)";
+		mappings_.clear();
+		const char* line = content_.c_str();
+		const char* const end = line + content_.size();
+		while (line < end)
+		{
+			const char* line_end = static_cast<const char*>(memchr(line, '\n', end - line));
+			if (line_end == nullptr)
+			{
+				line_end = end;
+			}
+			// start-end perms offset dev inode path
+			char* cursor = nullptr;
+			mapping one_mapping{};
+			one_mapping.start = std::strtoul(line, &cursor, 16);
+			one_mapping.end = std::strtoul(cursor + 1, &cursor, 16);
+			cursor++;
+			if (cursor + 4 <= line_end)
+			{
+				one_mapping.readable = cursor[0] == 'r';
+				one_mapping.writable = cursor[1] == 'w';
+				one_mapping.executable = cursor[2] == 'x';
+				one_mapping.offset = std::strtoul(cursor + 4, &cursor, 16);
+				// skip the device
+				while (cursor < line_end && *cursor == ' ')
+				{
+					cursor++;
+				}
+				while (cursor < line_end && *cursor != ' ')
+				{
+					cursor++;
+				}
+				one_mapping.inode = std::strtoul(cursor, &cursor, 10);
+				while (cursor < line_end && *cursor == ' ')
+				{
+					cursor++;
+				}
+				one_mapping.path.assign(cursor, line_end - cursor);
+				const std::size_t suffix_len = sizeof(deleted_suffix) - 1;
+				if (one_mapping.path.size() > suffix_len &&
+					one_mapping.path.compare(one_mapping.path.size() - suffix_len, suffix_len, deleted_suffix) == 0)
+				{
+					one_mapping.path.resize(one_mapping.path.size() - suffix_len);
+				}
+				if (one_mapping.end > one_mapping.start)
+				{
+					mappings_.push_back(std::move(one_mapping));
+				}
+			}
+			line = line_end + 1;
+		}
+		// the kernel lists mappings in address order already, this is cheap
+		std::sort(mappings_.begin(), mappings_.end(),
+			[](const mapping& a, const mapping& b) { return a.start < b.start; });
+	}
+
+	const mapping* MemoryMap::Find(std::uintptr_t addr) const
+	{
+		auto iter = std::upper_bound(mappings_.begin(), mappings_.end(), addr,
+			[](std::uintptr_t value, const mapping& one_mapping) { return value < one_mapping.start; });
+		if (iter == mappings_.begin())
+		{
+			return nullptr;
+		}
+		--iter;
+		return iter->contains(addr) ? &*iter : nullptr;
+	}
+
+	bool MemoryMap::Readable(const void* addr, std::size_t n_bytes) const
+	{
+		std::uintptr_t begin = reinterpret_cast<std::uintptr_t>(addr);
+		const std::uintptr_t end = begin + n_bytes;
+		if (end < begin)
+		{
+			return false;
+		}
+		const mapping* one_mapping = Find(begin);
+		if (one_mapping == nullptr)
+		{
+			return false;
+		}
+		for (;;)
+		{
+			if (!one_mapping->readable)
+			{
+				return false;
+			}
+			if (end <= one_mapping->end)
+			{
+				return true;
+			}
+			// the range continues into the next mapping if it starts right here
+			const mapping* next = one_mapping + 1;
+			if (next == mappings_.data() + mappings_.size() || next->start != one_mapping->end)
+			{
+				return false;
+			}
+			one_mapping = next;
+		}
+	}
+
+	std::uintptr_t MemoryMap::ModuleBase(const std::string& name, std::string* path) const
+	{
+		const mapping* first = nullptr;
+		for (const auto& one_mapping : mappings_)
+		{
+			if (one_mapping.path.empty() || one_mapping.path[0] != '/')
+			{
+				continue;
+			}
+			const auto slash = one_mapping.path.rfind('/');
+			if (one_mapping.path == name || one_mapping.path.compare(slash + 1, name.size(), name) == 0)
+			{
+				first = &one_mapping;
+				break;
+			}
+		}
+		if (first == nullptr)
+		{
+			return 0;
+		}
+		// every segment lies at or above the mapping of file offset 0
+		std::uintptr_t base = first->start - first->offset;
+		for (const auto& one_mapping : mappings_)
+		{
+			if (one_mapping.path == first->path)
+			{
+				base = std::min<std::uintptr_t>(base, one_mapping.start - one_mapping.offset);
+			}
+		}
+		if (path)
+		{
+			*path = first->path;
+		}
+		return base;
+	}
+
+	MappedMemory::MappedMemory(RemoteMemory& backend, MemoryMap& map)
+		: RemoteMemory(backend.pid()),
+		backend_(backend),
+		map_(map),
+		may_refresh_(true),
+		rejected_(0)
+	{
+	}
+
+	bool MappedMemory::Check(const void* addr, std::size_t n_bytes)
+	{
+		if (map_.Readable(addr, n_bytes))
+		{
+			return true;
+		}
+		if (may_refresh_)
+		{
+			may_refresh_ = false;
+			if (map_.Refresh() && map_.Readable(addr, n_bytes))
+			{
+				return true;
+			}
+		}
+		rejected_++;
+		return false;
+	}
+
+	read_result<void> MappedMemory::TryReadV(const remote_chunk* chunks, std::size_t n_chunks)
+	{
+		for (std::size_t i = 0; i < n_chunks; i++)
+		{
+			if (!Check(chunks[i].addr, chunks[i].len))
+			{
+				return read_failure(EFAULT, chunks[i].addr);
+			}
+		}
+		return backend_.TryReadV(chunks, n_chunks);
+	}
+}
@@ -0,0 +1,120 @@
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+#include <page_cache.h>
+
+namespace spiritsaway::cpy_frame
+{
+	PageCache::PageCache(RemoteMemory& backend)
+		: RemoteMemory(backend.pid()),
+		backend_(backend),
+		bypass_(backend.Kind() == RemoteMemoryKind::Ptrace),
+		page_size_(getpagesize()),
+		page_mask_(~(static_cast<std::uintptr_t>(page_size_) - 1)),
+		hits_(0),
+		misses_(0)
+	{
+	}
+
+	read_result<void> PageCache::TryReadV(const remote_chunk* chunks, std::size_t n_chunks)
+	{
+		if (bypass_)
+		{
+			return backend_.TryReadV(chunks, n_chunks);
+		}
+		std::vector<std::uintptr_t> missing;
+		for (std::size_t i = 0; i < n_chunks; i++)
+		{
+			if (chunks[i].len == 0)
+			{
+				continue;
+			}
+			const std::uintptr_t begin = reinterpret_cast<std::uintptr_t>(chunks[i].addr);
+			const std::uintptr_t last_page = (begin + chunks[i].len - 1) & page_mask_;
+			for (std::uintptr_t page = begin & page_mask_; page <= last_page; page += page_size_)
+			{
+				if (pages_.find(page) != pages_.end() ||
+					std::find(missing.begin(), missing.end(), page) != missing.end())
+				{
+					hits_++;
+				}
+				else
+				{
+					misses_++;
+					missing.push_back(page);
+				}
+			}
+		}
+		if (!missing.empty())
+		{
+			const auto fetched = FetchPages(missing.data(), missing.size());
+			if (!fetched)
+			{
+				return fetched;
+			}
+		}
+		for (std::size_t i = 0; i < n_chunks; i++)
+		{
+			CopyOut(reinterpret_cast<std::uintptr_t>(chunks[i].addr),
+				reinterpret_cast<uint8_t*>(chunks[i].dest), chunks[i].len);
+		}
+		return {};
+	}
+
+	void PageCache::Clear()
+	{
+		pages_.clear();
+	}
+
+	read_result<void> PageCache::FetchPages(const std::uintptr_t* pages, std::size_t n_pages)
+	{
+		std::vector<std::unique_ptr<uint8_t[]>> buffers(n_pages);
+		std::vector<remote_chunk> fetch(n_pages);
+		for (std::size_t i = 0; i < n_pages; i++)
+		{
+			buffers[i].reset(new uint8_t[page_size_]);
+			fetch[i] = { reinterpret_cast<void*>(pages[i]), buffers[i].get(), page_size_ };
+		}
+		if (backend_.TryReadV(fetch.data(), n_pages))
+		{
+			for (std::size_t i = 0; i < n_pages; i++)
+			{
+				pages_[pages[i]] = std::move(buffers[i]);
+			}
+			return {};
+		}
+		// one of the pages is not mapped, keep the readable ones and report the
+		// first failure to the caller
+		read_result<void> first_error;
+		for (std::size_t i = 0; i < n_pages; i++)
+		{
+			const auto result = backend_.TryReadV(&fetch[i], 1);
+			if (result)
+			{
+				pages_[pages[i]] = std::move(buffers[i]);
+			}
+			else if (first_error)
+			{
+				first_error = result;
+			}
+		}
+		return first_error;
+	}
+
+	void PageCache::CopyOut(std::uintptr_t addr, uint8_t* dest, std::size_t n_bytes)
+	{
+		while (n_bytes > 0)
+		{
+			const std::uintptr_t page = addr & page_mask_;
+			const std::size_t offset = addr - page;
+			const std::size_t n = std::min(n_bytes, page_size_ - offset);
+			memcpy(dest, pages_.at(page).get() + offset, n);
+			addr += n;
+			dest += n;
+			n_bytes -= n;
+		}
+	}
+}
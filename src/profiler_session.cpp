@@ -0,0 +1,376 @@
+#include <iostream>
+#include <sstream>
+
+#include <sys/ptrace.h>
+
+#include <custom_exceptions.h>
+#include <page_cache.h>
+#include <profiler_session.h>
+#include <ptrace_wrapper.h>
+
+namespace spiritsaway::cpy_frame
+{
+	using session_clock = std::chrono::steady_clock;
+
+	ProfilerSession::ProfilerSession(pid_t pid, bool non_stop, bool follow)
+		: pid_(pid),
+		non_stop_(non_stop),
+		follow_(follow)
+	{
+		if (follow_ && non_stop_)
+		{
+			throw FatalException("Following a process needs stop mode");
+		}
+		if (!non_stop_)
+		{
+			caller_ = std::make_unique<RemoteCaller>(pid_);
+		}
+		addrs_ = attach_python(pid_, non_stop_, &abi_, caller_.get());
+		attached_ = true;
+		paused_ = !non_stop_;
+		Setup();
+	}
+
+	ProfilerSession::ProfilerSession(pid_t child, const ProfilerSession& parent)
+		: pid_(child),
+		non_stop_(false),
+		follow_(parent.follow_)
+	{
+		// the parent's ThreadGroup left the child seized and stopped
+		attached_ = true;
+		paused_ = true;
+		abi_ = parent.abi_;
+		addrs_ = parent.addrs_;
+		exec_pending_ = parent.exec_pending_;
+		exec_deadline_ = parent.exec_deadline_;
+		caller_ = std::make_unique<RemoteCaller>(pid_);
+		Setup();
+	}
+
+	void ProfilerSession::Setup()
+	{
+		try
+		{
+			// pick the cheapest read path the kernel and container policy allow
+			mem_ = RemoteMemory::Probe(pid_, addrs_.tstate_addr);
+			maps_ = std::make_unique<MemoryMap>(pid_);
+			checked_mem_ = std::make_unique<MappedMemory>(*mem_, *maps_);
+			codes_ = std::make_unique<CodeCache>(addrs_.code_type_addr, addrs_.string_type_addr);
+			if (!non_stop_)
+			{
+				// the leader is seized and stopped already
+				threads_ = std::make_unique<ThreadGroup>(pid_, true, true, follow_);
+			}
+			std::cerr << "read target memory with " << remote_memory_kind_name(mem_->Kind()) << std::endl;
+			if (paused_)
+			{
+				Resume();
+			}
+		}
+		catch (...)
+		{
+			Detach();
+			throw;
+		}
+	}
+
+	ProfilerSession::~ProfilerSession()
+	{
+		try
+		{
+			Detach();
+		}
+		catch (const std::runtime_error& e)
+		{
+			std::cerr << "Failed to detach from " << pid_ << ": " << e.what() << std::endl;
+		}
+	}
+
+	void ProfilerSession::CheckAttached() const
+	{
+		if (!attached_)
+		{
+			std::ostringstream ss;
+			ss << "Session for PID " << pid_ << " is detached";
+			throw FatalException(ss.str());
+		}
+	}
+
+	void ProfilerSession::Pause()
+	{
+		CheckAttached();
+		if (non_stop_)
+		{
+			throw FatalException("A non-stop session can not pause the target");
+		}
+		if (!paused_)
+		{
+			threads_->Stop();
+			paused_ = true;
+			if (threads_->TakeExec())
+			{
+				// nothing of the old image is valid any more
+				exec_pending_ = true;
+				exec_deadline_ = session_clock::now() + std::chrono::milliseconds(MAX_ATTACH_WAIT_MS);
+				exec_candidates_.clear();
+				caller_->Abandon();
+			}
+		}
+	}
+
+	bool ProfilerSession::ResolveAfterExec()
+	{
+		const bool was_paused = paused_;
+		Pause();
+		bool resolved = false;
+		try
+		{
+			maps_->Refresh();
+			resolved = try_resolve_python(pid_, *maps_, caller_.get(), exec_candidates_, addrs_);
+		}
+		catch (const FatalException& e)
+		{
+			// a python we can not read
+			if (!was_paused)
+			{
+				Resume();
+			}
+			std::ostringstream ss;
+			ss << "PID " << pid_ << " exec'd an unsupported program: " << e.what();
+			throw TerminateException(ss.str());
+		}
+		catch (...)
+		{
+			if (!was_paused && paused_)
+			{
+				Resume();
+			}
+			throw;
+		}
+		if (resolved)
+		{
+			mem_ = RemoteMemory::Probe(pid_, addrs_.tstate_addr);
+			checked_mem_ = std::make_unique<MappedMemory>(*mem_, *maps_);
+			codes_->Retarget(addrs_.code_type_addr, addrs_.string_type_addr);
+			chains_ = ChainCache();
+			exec_pending_ = false;
+			std::cerr << "resolved the python of PID " << pid_ << " again after exec" << std::endl;
+		}
+		if (!was_paused)
+		{
+			Resume();
+		}
+		if (!resolved && session_clock::now() >= exec_deadline_)
+		{
+			std::ostringstream ss;
+			ss << "PID " << pid_ << " exec'd a program without python symbols";
+			throw TerminateException(ss.str());
+		}
+		return resolved;
+	}
+
+	std::vector<pid_t> ProfilerSession::TakeForked()
+	{
+		return threads_ ? threads_->TakeForked() : std::vector<pid_t>();
+	}
+
+	void ProfilerSession::Resume()
+	{
+		CheckAttached();
+		if (paused_)
+		{
+			threads_->Resume();
+			paused_ = false;
+		}
+	}
+
+	void ProfilerSession::Poll()
+	{
+		if (attached_ && threads_ && !paused_)
+		{
+			threads_->Poll();
+		}
+	}
+
+	void ProfilerSession::Detach()
+	{
+		if (!attached_)
+		{
+			return;
+		}
+		attached_ = false;
+		if (non_stop_)
+		{
+			return;
+		}
+		try
+		{
+			// PTRACE_DETACH needs a stopped tracee
+			if (!paused_)
+			{
+				if (threads_)
+				{
+					threads_->Stop();
+				}
+				else
+				{
+					ptrace_stop(pid_);
+				}
+			}
+			if (caller_)
+			{
+				try
+				{
+					caller_->Release();
+				}
+				catch (const PtraceException& e)
+				{
+					std::cerr << "Failed to release the remote call page of " << pid_ << ": " << e.what() << std::endl;
+				}
+			}
+			paused_ = false;
+			if (threads_)
+			{
+				threads_->Detach();
+			}
+			else
+			{
+				// the constructor failed before the other threads were seized
+				ptrace_detach(pid_);
+			}
+		}
+		catch (const TerminateException&)
+		{
+			// the target is gone, nothing left to release
+		}
+	}
+
+	// Capture with the target stopped and symbolize the sample. PTRACE_PEEKDATA
+	// needs a stopped target, every other backend symbolizes after resuming.
+	template <typename Symbolize>
+	static auto stopped_sample(ProfilerSession& session, bool enable_py_threads, ChainCache& chains,
+		std::chrono::nanoseconds* pause_time, Symbolize symbolize)
+	{
+		const bool was_paused = session.paused();
+		const auto pause_start = session_clock::now();
+		session.Pause();
+		if (session.exec_pending())
+		{
+			// the new image is resolved by the next sample
+			if (!was_paused)
+			{
+				session.Resume();
+			}
+			if (pause_time)
+			{
+				*pause_time = was_paused ? std::chrono::nanoseconds(0) : session_clock::now() - pause_start;
+			}
+			return decltype(symbolize(raw_sample()))();
+		}
+		try
+		{
+			raw_sample sample;
+			{
+				// one page cache serves the whole capture
+				PageCache cache(session.memory());
+				auto captured = try_capture_py_threads(cache, session.addresses(), enable_py_threads, &chains);
+				if (!captured)
+				{
+					throw_read_error(session.pid(), captured.error());
+				}
+				sample = std::move(*captured);
+			}
+			if (!was_paused && session.memory().Kind() != RemoteMemoryKind::Ptrace)
+			{
+				session.Resume();
+			}
+			auto pause_end = session_clock::now();
+			auto py_threads = symbolize(sample);
+			if (!was_paused && session.paused())
+			{
+				session.Resume();
+				pause_end = session_clock::now();
+			}
+			if (pause_time)
+			{
+				*pause_time = was_paused ? std::chrono::nanoseconds(0) : pause_end - pause_start;
+			}
+			return py_threads;
+		}
+		catch (const PtraceException&)
+		{
+			if (!was_paused && session.paused())
+			{
+				session.Resume();
+			}
+			throw;
+		}
+	}
+
+	std::vector<py_thread> ProfilerSession::Sample(bool enable_py_threads)
+	{
+		CheckAttached();
+		if (exec_pending_ && !ResolveAfterExec())
+		{
+			return {};
+		}
+		// the mappings may be refreshed once per sample
+		checked_mem_->Rearm();
+		if (non_stop_)
+		{
+			return trace_py_threads_nonstop(*checked_mem_, addrs_, enable_py_threads, MAX_NONSTOP_RETRIES, codes_.get());
+		}
+		return stopped_sample(*this, enable_py_threads, chains_, nullptr,
+			[this](const raw_sample& sample) { return symbolize_py_threads(*checked_mem_, *codes_, sample); });
+	}
+
+	std::vector<interned_py_thread> ProfilerSession::SampleInterned(bool enable_py_threads,
+		std::chrono::nanoseconds* pause_time)
+	{
+		CheckAttached();
+		if (exec_pending_)
+		{
+			const auto resolve_start = session_clock::now();
+			const bool resolved = ResolveAfterExec();
+			if (!resolved)
+			{
+				if (pause_time)
+				{
+					*pause_time = session_clock::now() - resolve_start;
+				}
+				return {};
+			}
+		}
+		checked_mem_->Rearm();
+		if (non_stop_)
+		{
+			if (pause_time)
+			{
+				*pause_time = std::chrono::nanoseconds(0);
+			}
+			return InternThreads(trace_py_threads_nonstop(*checked_mem_, addrs_, enable_py_threads,
+				MAX_NONSTOP_RETRIES, codes_.get()));
+		}
+		return stopped_sample(*this, enable_py_threads, chains_, pause_time,
+			[this](const raw_sample& sample) { return symbolize_py_threads_interned(*checked_mem_, *codes_, sample); });
+	}
+
+	std::vector<interned_py_thread> ProfilerSession::InternThreads(const std::vector<py_thread>& py_threads)
+	{
+		StringTable& strings = codes_->strings();
+		std::vector<interned_py_thread> result;
+		result.reserve(py_threads.size());
+		for (const auto& one_thread : py_threads)
+		{
+			interned_py_thread this_thread{ one_thread.id, one_thread.is_current, {}, one_thread.consistent };
+			this_thread.frames.reserve(one_thread.frames.size());
+			for (const auto& frame : one_thread.frames)
+			{
+				this_thread.frames.push_back({ strings.Intern(frame.file), strings.Intern(frame.name),
+					static_cast<std::uint32_t>(frame.line) });
+			}
+			result.push_back(std::move(this_thread));
+		}
+		return result;
+	}
+}
@@ -1,7 +1,6 @@
 
 
-#include <dirent.h>
-
+#include <algorithm>
 #include <cassert>
 #include <cerrno>
 #include <cstring>
@@ -12,9 +11,9 @@
 #include <utility>
 #include <vector>
 
-#include <sys/mman.h>
 #include <sys/ptrace.h>
 #include <sys/syscall.h>
+#include <sys/uio.h>
 #include <sys/user.h>
 #include <sys/wait.h>
 
@@ -89,6 +88,85 @@ namespace spiritsaway::cpy_frame
 		}
 		ptrace_wait(pid);
 	}
+	void ptrace_stop(pid_t pid)
+	{
+		if (ptrace(PTRACE_INTERRUPT, pid, 0, 0)) {
+			std::ostringstream ss;
+			ss << "Failed to PTRACE_INTERRUPT PID " << pid << ": " << strerror(errno);
+			throw PtraceException(ss.str());
+		}
+		int status;
+		for (;;) {
+			if (waitpid(pid, &status, __WALL) == -1) {
+				std::ostringstream ss;
+				ss << "Failed to waitpid() PID " << pid << ": " << strerror(errno);
+				throw PtraceException(ss.str());
+			}
+			if (WIFEXITED(status) || WIFSIGNALED(status)) {
+				std::ostringstream ss;
+				ss << "Child process " << pid << " exited with status " << status;
+				throw TerminateException(ss.str());
+			}
+			if (!WIFSTOPPED(status)) {
+				continue;
+			}
+			if ((status >> 16) == PTRACE_EVENT_STOP) {
+				return;
+			}
+			// a signal arrived before our interrupt took effect: deliver it, the
+			// interrupt stays pending and is reported next
+			int signum = WSTOPSIG(status);
+			if (ptrace(PTRACE_CONT, pid, 0, signum == SIGTRAP ? 0 : signum) == -1) {
+				std::ostringstream ss;
+				ss << "Failed to PTRACE_CONT PID " << pid << ": " << strerror(errno);
+				throw PtraceException(ss.str());
+			}
+		}
+	}
+
+	void ptrace_pass_signals(pid_t pid)
+	{
+		int status;
+		for (;;) {
+			const pid_t ret = waitpid(pid, &status, __WALL | WNOHANG);
+			if (ret == 0) {
+				return;
+			}
+			if (ret == -1) {
+				if (errno == EINTR) {
+					continue;
+				}
+				std::ostringstream ss;
+				ss << "Failed to waitpid() PID " << pid << ": " << strerror(errno);
+				throw PtraceException(ss.str());
+			}
+			if (WIFEXITED(status) || WIFSIGNALED(status)) {
+				std::ostringstream ss;
+				ss << "Child process " << pid << " exited with status " << status;
+				throw TerminateException(ss.str());
+			}
+			if (!WIFSTOPPED(status)) {
+				continue;
+			}
+			// a group-stop stays stopped for job control, every other stop
+			// carries a signal for the tracee
+			if ((status >> 16) == PTRACE_EVENT_STOP) {
+				if (ptrace(PTRACE_LISTEN, pid, 0, 0) == -1) {
+					std::ostringstream ss;
+					ss << "Failed to PTRACE_LISTEN PID " << pid << ": " << strerror(errno);
+					throw PtraceException(ss.str());
+				}
+				continue;
+			}
+			const int signum = WSTOPSIG(status);
+			if (ptrace(PTRACE_CONT, pid, 0, signum == SIGTRAP ? 0 : signum) == -1) {
+				std::ostringstream ss;
+				ss << "Failed to PTRACE_CONT PID " << pid << ": " << strerror(errno);
+				throw PtraceException(ss.str());
+			}
+		}
+	}
+
 	void ptrace_attach(pid_t pid)
 	{
 		if (ptrace(PTRACE_ATTACH, pid, 0, 0)) {
@@ -113,67 +191,213 @@ namespace spiritsaway::cpy_frame
 		}
 	}
 
-	long ptrace_peek(pid_t pid, void* addr)
+	void throw_read_error(pid_t pid, const read_error& error)
+	{
+		std::ostringstream ss;
+		ss << "Failed to read PID " << pid << " at " << error.addr << ": " << strerror(error.err);
+		throw PtraceException(ss.str());
+	}
+
+	read_result<long> try_ptrace_peek(pid_t pid, void* addr)
 	{
 		errno = 0;
 		long data = ptrace(PTRACE_PEEKDATA, pid, addr, 0);
 		if (data == -1 && errno != 0)
 		{
-			std::ostringstream ss;
-			ss << "Failed to PTRACE_PEEKDATA (pid " << pid << ", addr "
-				<< reinterpret_cast<void*>(addr) << "): " << strerror(errno);
-			throw PtraceException(ss.str());
+			return read_failure(errno, addr);
 		}
 		return data;
 	}
 
+	read_result<void*> try_ptrace_peek_ptr(pid_t pid, void* addr)
+	{
+		return try_ptrace_peek(pid, addr).map([](long data) { return reinterpret_cast<void*>(data); });
+	}
+
+	// the message the PTRACE_PEEKDATA callers always got
+	[[noreturn]] static void throw_peek_error(pid_t pid, const read_error& error)
+	{
+		std::ostringstream ss;
+		ss << "Failed to PTRACE_PEEKDATA (pid " << pid << ", addr "
+			<< error.addr << "): " << strerror(error.err);
+		throw PtraceException(ss.str());
+	}
+
+	long ptrace_peek(pid_t pid, void* addr)
+	{
+		const auto data = try_ptrace_peek(pid, addr);
+		if (!data)
+		{
+			throw_peek_error(pid, data.error());
+		}
+		return *data;
+	}
+
 	void* ptrace_peek_ptr(pid_t pid, void* addr)
 	{
-		errno = 0;
-		long data = ptrace(PTRACE_PEEKDATA, pid, addr, 0);
-		if (data == -1 && errno != 0)
+		return reinterpret_cast<void*>(ptrace_peek(pid, addr));
+	}
+	read_result<void> try_ptrace_peek_read(pid_t pid, void* addr, void* dest, std::size_t n_bytes)
+	{
+		uint8_t* out = reinterpret_cast<uint8_t*>(dest);
+		std::size_t off = 0;
+		while (off < n_bytes)
+		{
+			const auto val = try_ptrace_peek(pid, addr + off);
+			if (!val)
+			{
+				return tl::make_unexpected(val.error());
+			}
+			const std::size_t n = std::min(sizeof(*val), n_bytes - off);
+			memcpy(out + off, &*val, n);
+			off += n;
+		}
+		return {};
+	}
+
+	void ptrace_peek_read(pid_t pid, void* addr, void* dest, std::size_t n_bytes)
+	{
+		const auto result = try_ptrace_peek_read(pid, addr, dest, n_bytes);
+		if (!result)
+		{
+			throw_peek_error(pid, result.error());
+		}
+	}
+
+	read_result<bool> try_ptrace_vm_readv(pid_t pid, const remote_chunk* chunks, std::size_t n_chunks)
+	{
+		// IOV_MAX is 1024 on linux
+		static const std::size_t max_iov = 1024;
+		iovec local[max_iov];
+		iovec remote[max_iov];
+		std::size_t done = 0;
+		while (done < n_chunks)
+		{
+			const std::size_t batch = std::min(max_iov, n_chunks - done);
+			std::size_t expected = 0;
+			for (std::size_t i = 0; i < batch; i++)
+			{
+				const remote_chunk& one = chunks[done + i];
+				local[i].iov_base = one.dest;
+				local[i].iov_len = one.len;
+				remote[i].iov_base = one.addr;
+				remote[i].iov_len = one.len;
+				expected += one.len;
+			}
+			const ssize_t n = process_vm_readv(pid, local, batch, remote, batch, 0);
+			if (n == -1 && (errno == ENOSYS || errno == EPERM))
+			{
+				return false;
+			}
+			if (n != static_cast<ssize_t>(expected))
+			{
+				// locate the first chunk that was not transferred
+				std::size_t left = n < 0 ? 0 : n;
+				std::size_t i = 0;
+				while (i < batch && left >= remote[i].iov_len)
+				{
+					left -= remote[i].iov_len;
+					i++;
+				}
+				return read_failure(n < 0 ? errno : EFAULT, static_cast<uint8_t*>(remote[i].iov_base) + left);
+			}
+			done += batch;
+		}
+		return true;
+	}
+
+	bool ptrace_vm_readv(pid_t pid, const remote_chunk* chunks, std::size_t n_chunks)
+	{
+		const auto result = try_ptrace_vm_readv(pid, chunks, n_chunks);
+		if (!result)
 		{
 			std::ostringstream ss;
-			ss << "Failed to PTRACE_PEEKDATA (pid " << pid << ", addr "
-				<< reinterpret_cast<void*>(addr) << "): " << strerror(errno);
+			ss << "Failed to process_vm_readv (pid " << pid << ", addr "
+				<< result.error().addr << "): " << strerror(result.error().err);
 			throw PtraceException(ss.str());
 		}
-		return (void*)data;
+		return *result;
 	}
-	std::string ptrace_peek_string(pid_t pid, void* addr)
+
+	read_result<void> try_ptrace_readv(pid_t pid, const remote_chunk* chunks, std::size_t n_chunks)
 	{
-		std::ostringstream dump;
-		unsigned long off = 0;
-		while (true) {
-			const long val = ptrace_peek(pid, addr + off);
+		// stateless, the backends of RemoteMemory remember a refusal per target
+		const auto result = try_ptrace_vm_readv(pid, chunks, n_chunks);
+		if (!result)
+		{
+			return tl::make_unexpected(result.error());
+		}
+		if (*result)
+		{
+			return {};
+		}
+		for (std::size_t i = 0; i < n_chunks; i++)
+		{
+			const auto result = try_ptrace_peek_read(pid, chunks[i].addr, chunks[i].dest, chunks[i].len);
+			if (!result)
+			{
+				return result;
+			}
+		}
+		return {};
+	}
 
-			// XXX: this can be micro-optimized, c.f.
-			// https://graphics.stanford.edu/~seander/bithacks.html#ZeroInWord
-			const std::string chunk(reinterpret_cast<const char*>(&val), sizeof(val));
-			dump << chunk.c_str();
-			if (chunk.find_first_of('\0') != std::string::npos) {
+	void ptrace_readv(pid_t pid, const remote_chunk* chunks, std::size_t n_chunks)
+	{
+		const auto result = try_ptrace_readv(pid, chunks, n_chunks);
+		if (!result)
+		{
+			throw_read_error(pid, result.error());
+		}
+	}
+
+	read_result<void> try_ptrace_read(pid_t pid, void* addr, void* dest, std::size_t n_bytes)
+	{
+		remote_chunk chunk{ addr, dest, n_bytes };
+		return try_ptrace_readv(pid, &chunk, 1);
+	}
+
+	void ptrace_read(pid_t pid, void* addr, void* dest, std::size_t n_bytes)
+	{
+		remote_chunk chunk{ addr, dest, n_bytes };
+		ptrace_readv(pid, &chunk, 1);
+	}
+
+	std::string ptrace_peek_string(pid_t pid, void* addr)
+	{
+		// read in blocks that never cross a page boundary, so that a string near the
+		// end of a mapping does not fault on the unmapped page after it
+		static const std::size_t block_size = 256;
+		const std::size_t page_size = getpagesize();
+		std::string result;
+		char block[block_size];
+		while (true)
+		{
+			const std::size_t to_page_end = page_size - reinterpret_cast<std::size_t>(addr) % page_size;
+			const std::size_t n = std::min(block_size, to_page_end);
+			ptrace_read(pid, addr, block, n);
+			const void* end = memchr(block, '\0', n);
+			if (end != nullptr)
+			{
+				result.append(block, reinterpret_cast<const char*>(end) - block);
 				break;
 			}
-			off += sizeof(val);
+			result.append(block, n);
+			addr += n;
 		}
-		return dump.str();
+		return result;
 	}
 
 
 	std::unique_ptr<uint8_t[]> ptrace_peek_bytes(pid_t pid, void* addr, std::size_t n_bytes)
 	{
-		// align the buffer to a word size
-		if (n_bytes % sizeof(long)) {
-			n_bytes = (n_bytes / sizeof(long) + 1) * sizeof(long);
-		}
-		std::unique_ptr<uint8_t[]> bytes(new uint8_t[n_bytes]);
-
-		size_t off = 0;
-		while (off < n_bytes) {
-			const long val = ptrace_peek(pid, addr + off);
-			memmove(bytes.get() + off, &val, sizeof(val));
-			off += sizeof(val);
+		// keep the buffer aligned to a word size as callers used to rely on it
+		std::size_t buffer_size = n_bytes;
+		if (buffer_size % sizeof(long)) {
+			buffer_size = (buffer_size / sizeof(long) + 1) * sizeof(long);
 		}
+		std::unique_ptr<uint8_t[]> bytes(new uint8_t[buffer_size]());
+		ptrace_read(pid, addr, bytes.get(), n_bytes);
 		return bytes;
 	}
 
@@ -209,110 +433,4 @@ namespace spiritsaway::cpy_frame
 		}
 		ptrace_wait(pid);
 	}
-	static const long syscall_x86 = 0x050f;  // x86 code for SYSCALL
-
-	static unsigned long probe_ = 0;
-
-	static unsigned long AllocPage(pid_t pid)
-	{
-		user_regs_struct oldregs = ptrace_get_regs(pid);
-		// rip 指令为x64架构下的程序计数器 保存的是下一个要执行的指令id
-		long orig_code = ptrace_peek(pid, (void*)oldregs.rip);
-		ptrace_poke(pid, (void*)oldregs.rip, (void*)syscall_x86);
-		// 这个是设置rip为syscall_x86 然后下面的参数是调用syscall 的相关参数
-		// 意思就是分配一页内存区域
-		user_regs_struct newregs = oldregs;
-		newregs.rax = SYS_mmap;
-		newregs.rdi = 0;                                   // addr
-		newregs.rsi = getpagesize();                       // len
-		newregs.rdx = PROT_READ | PROT_WRITE | PROT_EXEC;  // prot
-		newregs.r10 = MAP_PRIVATE | MAP_ANONYMOUS;         // flags
-		newregs.r8 = -1;                                   // fd
-		newregs.r9 = 0;                                    // offset
-		ptrace_set_regs(pid, newregs);
-		// 设置好所有寄存器之后 单步执行这个系统调用
-		ptrace_single_step(pid);
-		// x64架构下 如果返回单个整数 结果会存储在rax寄存器里
-		unsigned long result = ptrace_get_regs(pid).rax;
-		// 再恢复原来的现场
-		ptrace_set_regs(pid, oldregs);
-		// 重新恢复之前的程序计数器
-		ptrace_poke(pid, (void*)oldregs.rip, (void*)orig_code);
-
-		return result;
-	}
-
-	static std::vector<pid_t> ListThreads(pid_t pid)
-	{
-		std::vector<pid_t> result;
-		std::ostringstream dirname;
-		dirname << "/proc/" << pid << "/task";
-		DIR* dir = opendir(dirname.str().c_str());
-		if (dir == nullptr) {
-			throw PtraceException("Failed to list threads");
-		}
-		dirent* entry;
-		while ((entry = readdir(dir)) != nullptr) {
-			std::string name = entry->d_name;
-			if (name != "." && name != "..") {
-				result.push_back(static_cast<pid_t>(std::stoi(name)));
-			}
-		}
-		return result;
-	}
-
-	static void PauseChildThreads(pid_t pid)
-	{
-		for (auto tid : ListThreads(pid)) {
-			if (tid != pid) ptrace_attach(tid);
-		}
-	}
-
-	static void ResumeChildThreads(pid_t pid)
-	{
-		for (auto tid : ListThreads(pid)) {
-			if (tid != pid) ptrace_detach(tid);
-		}
-	}
-
-	long ptrace_call_function(pid_t pid, long addr)
-	{
-		// 这里会预先分配一页内存区，然后内存区的前三个字节里有两个指令
-		// 第一条是call rax 就是将rax里的函数指针执行
-		// 第二条就是trap 相当于call rax之后进入中断
-		if (probe_ == 0) {
-			PauseChildThreads(pid);
-			probe_ = AllocPage(pid);
-			ResumeChildThreads(pid);
-			if (probe_ == (unsigned long)MAP_FAILED) {
-				return -1;
-			}
-
-			long code = 0;
-			uint8_t* new_code_bytes = (uint8_t*)&code;
-			new_code_bytes[0] = 0xff;  // CALL
-			new_code_bytes[1] = 0xd0;  // rax
-			new_code_bytes[2] = 0xcc;  // TRAP
-			ptrace_poke(pid, (void*)probe_, (void*)code);
-		}
-
-		user_regs_struct oldregs = ptrace_get_regs(pid);
-		user_regs_struct newregs = oldregs;
-		// 这里的操作就是把返回地址寄存器rip的值设置为我们之前定好的prob
-		// 同时设置rax为我们要调用的函数指针
-		newregs.rax = addr;
-		newregs.rip = probe_;
-		// 设置好之后 恢复原来程序的执行
-		// 恢复之后就会自动的执行addr对应的函数 然后进入中断
-		ptrace_set_regs(pid, newregs);
-		ptrace_condition(pid);
-		ptrace_wait(pid);
-		// 这里addr的函数执行完成，对应的返回值会再rax寄存器里
-		newregs = ptrace_get_regs(pid);
-		// 再恢复原来的现场
-		ptrace_set_regs(pid, oldregs);
-
-		// 目前的限制好像是必须调用的是无参数的函数
-		return newregs.rax;
-	};
 }
\ No newline at end of file
@@ -0,0 +1,381 @@
+#include <algorithm>
+#include <iostream>
+#include <sstream>
+#include <thread>
+
+#include <custom_exceptions.h>
+#include <py_sampler.h>
+
+namespace spiritsaway::cpy_frame
+{
+	using sample_clock = std::chrono::steady_clock;
+
+	static sample_clock::duration tick_period(double rate_hz)
+	{
+		return std::chrono::duration_cast<sample_clock::duration>(std::chrono::duration<double>(1.0 / rate_hz));
+	}
+
+	// Schedule the tick after a sample that ended at now, skipping the ticks it overran.
+	static void advance_tick(sample_clock::time_point& next_tick, sample_clock::time_point now,
+		sample_clock::duration period, sampler_stats& stats)
+	{
+		next_tick += period;
+		if (now >= next_tick)
+		{
+			const auto behind = (now - next_tick) / period + 1;
+			stats.missed_ticks += behind;
+			next_tick += behind * period;
+		}
+	}
+
+	// Returns the time the target was stopped.
+	static std::chrono::nanoseconds sample_into(ProfilerSession& session, bool enable_py_threads, StackTrie& trie,
+		sampler_stats& stats)
+	{
+		std::chrono::nanoseconds pause{ 0 };
+		const auto py_threads = session.SampleInterned(enable_py_threads, &pause);
+		// a thread stopped for a signal or a fork since the resume goes on now,
+		// not at the next tick
+		session.Poll();
+		stats.pause_time += pause;
+		stats.max_pause = std::max(stats.max_pause, pause);
+		if (const ThreadGroup* threads = session.threads())
+		{
+			stats.freeze_time += threads->stats().freeze_time;
+			stats.max_freeze_skew = std::max(stats.max_freeze_skew, threads->stats().skew);
+			stats.frozen_threads = threads->stats().threads;
+		}
+		for (const auto& one_thread : py_threads)
+		{
+			if (!one_thread.consistent)
+			{
+				stats.best_effort_threads++;
+			}
+			trie.Insert(one_thread.frames);
+		}
+		return pause;
+	}
+
+	PySampler::PySampler(pid_t pid, const sampler_options& options)
+		: pid_(pid),
+		options_(options)
+	{
+		if (options_.rate_hz <= 0)
+		{
+			throw FatalException("Sampling rate must be positive");
+		}
+	}
+
+	const sampler_stats& PySampler::Run(const std::atomic<bool>* stop)
+	{
+		if (!session_ || !session_->attached())
+		{
+			session_ = std::make_unique<ProfilerSession>(pid_, options_.non_stop);
+		}
+
+		const auto period = tick_period(options_.rate_hz);
+		const auto start = sample_clock::now();
+		const auto end = start + options_.duration;
+		auto next_tick = start;
+		while (!(stop && stop->load()))
+		{
+			if (options_.duration.count() && next_tick >= end)
+			{
+				break;
+			}
+			std::this_thread::sleep_until(next_tick);
+			stats_.ticks++;
+			const auto sample_start = sample_clock::now();
+			try
+			{
+				SampleOnce();
+				stats_.samples++;
+			}
+			catch (const TerminateException& e)
+			{
+				std::cerr << e.what() << std::endl;
+				break;
+			}
+			catch (const PtraceException& e)
+			{
+				stats_.failed_samples++;
+			}
+			const auto now = sample_clock::now();
+			stats_.sample_time += now - sample_start;
+			advance_tick(next_tick, now, period, stats_);
+		}
+		try
+		{
+			session_->Detach();
+		}
+		catch (const std::runtime_error& e)
+		{
+			std::cerr << "Failed to detach from " << pid_ << ": " << e.what() << std::endl;
+		}
+		return stats_;
+	}
+
+	void PySampler::SampleOnce()
+	{
+		sample_into(*session_, options_.enable_py_threads, trie_, stats_);
+	}
+
+	struct PoolSampler::target_state
+	{
+		pool_target target;
+		std::unique_ptr<ProfilerSession> session;
+		// ids of session->strings(), merged into profile after each Run
+		StackTrie samples;
+		StackTrie profile;
+		StringTable strings;
+		sample_clock::time_point next_tick;
+		bool active = false;
+	};
+
+	static void add_stats(sampler_stats& total, const sampler_stats& one)
+	{
+		total.ticks += one.ticks;
+		total.samples += one.samples;
+		total.missed_ticks += one.missed_ticks;
+		total.throttled_ticks += one.throttled_ticks;
+		total.failed_samples += one.failed_samples;
+		total.best_effort_threads += one.best_effort_threads;
+		total.pause_time += one.pause_time;
+		total.max_pause = std::max(total.max_pause, one.max_pause);
+		total.freeze_time += one.freeze_time;
+		total.max_freeze_skew = std::max(total.max_freeze_skew, one.max_freeze_skew);
+		total.frozen_threads += one.frozen_threads;
+		total.sample_time += one.sample_time;
+	}
+
+	PoolSampler::PoolSampler(const std::vector<pid_t>& pids, const pool_options& options)
+		: options_(options)
+	{
+		if (options_.rate_hz <= 0)
+		{
+			throw FatalException("Sampling rate must be positive");
+		}
+		if (options_.max_overhead <= 0)
+		{
+			throw FatalException("Overhead budget must be positive");
+		}
+		if (pids.empty())
+		{
+			throw FatalException("No process to sample");
+		}
+		if (options_.follow && options_.non_stop)
+		{
+			throw FatalException("Following children needs stop mode");
+		}
+		workers_ = options_.workers ? options_.workers : std::max(1u, std::thread::hardware_concurrency());
+		workers_ = std::min(workers_, pids.size());
+		for (pid_t pid : pids)
+		{
+			targets_.push_back({ pid, sampler_stats(), std::string() });
+			states_.push_back(std::make_unique<target_state>());
+			states_.back()->target = targets_.back();
+		}
+	}
+
+	PoolSampler::~PoolSampler() = default;
+
+	const sampler_stats& PoolSampler::Run(const std::atomic<bool>* stop)
+	{
+		const auto start = sample_clock::now();
+		std::vector<std::thread> threads;
+		// children each worker adopted, kept apart until the workers are done
+		std::vector<std::vector<std::unique_ptr<target_state>>> born(workers_);
+		for (std::size_t i = 0; i < workers_; i++)
+		{
+			threads.emplace_back(&PoolSampler::RunWorker, this, i, start, stop, &born[i]);
+		}
+		for (auto& one_thread : threads)
+		{
+			one_thread.join();
+		}
+		for (auto& one_worker : born)
+		{
+			for (auto& state : one_worker)
+			{
+				states_.push_back(std::move(state));
+			}
+		}
+
+		stats_ = sampler_stats();
+		targets_.clear();
+		for (const auto& one_state : states_)
+		{
+			target_state& state = *one_state;
+			if (state.session)
+			{
+				state.profile.Merge(state.samples, state.session->strings(), state.strings);
+				trie_.Merge(state.samples, state.session->strings(), strings_);
+				state.samples = StackTrie();
+				state.session.reset();
+			}
+			targets_.push_back(state.target);
+			add_stats(stats_, state.target.stats);
+		}
+		return stats_;
+	}
+
+	void PoolSampler::RunWorker(std::size_t worker, sample_clock::time_point start, const std::atomic<bool>* stop,
+		std::vector<std::unique_ptr<target_state>>* born)
+	{
+		std::vector<target_state*> mine;
+		for (std::size_t i = worker; i < states_.size(); i += workers_)
+		{
+			mine.push_back(states_[i].get());
+		}
+		const auto period = tick_period(options_.rate_hz);
+		const auto end = start + options_.duration;
+		const auto drop = [](target_state& state, const char* error)
+		{
+			state.target.error = error;
+			state.active = false;
+			try
+			{
+				state.session->Detach();
+			}
+			catch (const std::exception&)
+			{
+			}
+		};
+		for (std::size_t k = 0; k < mine.size(); k++)
+		{
+			target_state& state = *mine[k];
+			pool_target& target = state.target;
+			try
+			{
+				state.session = std::make_unique<ProfilerSession>(target.pid, options_.non_stop, options_.follow);
+				state.active = true;
+				target.error.clear();
+			}
+			catch (const std::exception& e)
+			{
+				target.error = e.what();
+				state.active = false;
+				continue;
+			}
+			// spread the targets over the period rather than stopping them all at once
+			state.next_tick = std::max(sample_clock::now(), start + period * static_cast<long>(k) / static_cast<long>(mine.size()));
+		}
+
+		while (!(stop && stop->load()))
+		{
+			std::size_t next = mine.size();
+			for (std::size_t k = 0; k < mine.size(); k++)
+			{
+				const target_state& state = *mine[k];
+				if (state.active && (next == mine.size() || state.next_tick < mine[next]->next_tick))
+				{
+					next = k;
+				}
+			}
+			if (next == mine.size())
+			{
+				break;
+			}
+			target_state& state = *mine[next];
+			pool_target& target = state.target;
+			if (options_.duration.count() && state.next_tick >= end)
+			{
+				break;
+			}
+			std::this_thread::sleep_until(state.next_tick);
+			target.stats.ticks++;
+			const auto sample_start = sample_clock::now();
+			std::chrono::nanoseconds pause{ 0 };
+			try
+			{
+				pause = sample_into(*state.session, options_.enable_py_threads, state.samples, target.stats);
+				target.stats.samples++;
+			}
+			catch (const TerminateException& e)
+			{
+				// e.g. it exec'd something else, let it go right away
+				drop(state, e.what());
+				continue;
+			}
+			catch (const PtraceException& e)
+			{
+				target.stats.failed_samples++;
+			}
+			catch (const std::exception& e)
+			{
+				// anything else is this target's alone, keep sampling the others
+				target.stats.failed_samples++;
+				drop(state, e.what());
+				continue;
+			}
+			const auto now = sample_clock::now();
+			target.stats.sample_time += now - sample_start;
+			advance_tick(state.next_tick, now, period, target.stats);
+
+			// keep the cost of this target within its budget
+			const std::chrono::nanoseconds cost = options_.non_stop ?
+				std::chrono::duration_cast<std::chrono::nanoseconds>(now - sample_start) : pause;
+			const auto earliest = sample_start + std::chrono::duration_cast<sample_clock::duration>(
+				std::chrono::duration<double, std::nano>(cost.count() / options_.max_overhead));
+			if (earliest > state.next_tick)
+			{
+				const auto skipped = (earliest - state.next_tick + period - sample_clock::duration(1)) / period;
+				target.stats.throttled_ticks += skipped;
+				state.next_tick += skipped * period;
+			}
+
+			// a forked child stays on this thread, its tracer, and is sampled
+			// like its parent from now on
+			for (pid_t child : state.session->TakeForked())
+			{
+				auto adopted = std::make_unique<target_state>();
+				adopted->target.pid = child;
+				try
+				{
+					adopted->session = std::make_unique<ProfilerSession>(child, *state.session);
+					adopted->active = true;
+				}
+				catch (const std::exception& e)
+				{
+					adopted->target.error = e.what();
+				}
+				adopted->next_tick = state.next_tick;
+				mine.push_back(adopted.get());
+				born->push_back(std::move(adopted));
+			}
+		}
+
+		for (target_state* one_state : mine)
+		{
+			target_state& state = *one_state;
+			if (!state.session)
+			{
+				continue;
+			}
+			try
+			{
+				state.session->Detach();
+			}
+			catch (const std::exception& e)
+			{
+				std::cerr << "Failed to detach from " << state.target.pid << ": " << e.what() << std::endl;
+			}
+			state.active = false;
+		}
+	}
+
+	void PoolSampler::WriteFolded(std::ostream& os, bool per_pid) const
+	{
+		if (!per_pid)
+		{
+			trie_.WriteFolded(os, strings_);
+			return;
+		}
+		for (std::size_t i = 0; i < states_.size(); i++)
+		{
+			std::ostringstream prefix;
+			prefix << "pid " << states_[i]->target.pid;
+			states_[i]->profile.WriteFolded(os, states_[i]->strings, prefix.str());
+		}
+	}
+}
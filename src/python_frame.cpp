@@ -1,9 +1,13 @@
 
 
+#include <algorithm>
+#include <chrono>
+#include <cstring>
 #include <sstream>
 #include <fstream>
 #include <iostream>
 #include <thread>
+#include <unordered_set>
 
 #include <python2.7/Python.h>
 #include <python2.7/frameobject.h>
@@ -12,113 +16,229 @@
 #include <custom_exceptions.h>
 #include <ptrace_wrapper.h>
 #include <python_frame.h>
+#include <remote_memory.h>
+#include <memory_map.h>
+#include <interp_locator.h>
+#include <page_cache.h>
+#include <code_cache.h>
+#include <profiler_session.h>
 #include <posix_file_util.h>
 
 namespace spiritsaway::cpy_frame
 {
 
 #define ENABLE_THREADS 1
-    // return the aslr address of libpython in dest process
-    // read the maps file to get so begin address
-    std::size_t locate_lib_python(pid_t pid, const std::string& hint, std::string& path)
+    // Everything we decode from a remote frame lies before the block stack, so
+    // the snapshot stops there instead of copying the whole sizeof(_frame).
+    static const std::size_t frame_snapshot_size = offsetof(PyFrameObject, f_blockstack);
+
+    // One step of a frame walk: the code header of the current frame and the
+    // snapshot of the next frame are fetched with a single vectored read. The
+    // rest of the code object is only read by the CodeCache on a miss.
+    read_result<void> ReadStep(RemoteMemory& mem, const PyFrameObject& frame, code_header& code, PyFrameObject& next)
     {
-        std::ostringstream ss;
-        ss << "/proc/" << pid << "/maps";
-        std::ifstream fp(ss.str());
-        std::string line;
-        std::string elf_path;
-        while (std::getline(fp, line)) {
-            if (line.find(hint) != std::string::npos &&
-                line.find(" r-xp ") != std::string::npos) {
-                size_t pos = line.find('/');
-                if (pos == std::string::npos) {
-                    throw FatalException("Did not find libpython absolute path");
-                }
-                path = line.substr(pos);
-                pos = line.find('-');
-                if (pos == std::string::npos) {
-                    throw FatalException("Did not find libpython virtual memory address");
-                }
-                return std::strtoul(line.substr(0, pos).c_str(), nullptr, 16);
+        remote_chunk chunks[3];
+        code_header::Chunks(frame.f_code, code, chunks);
+        chunks[2] = { frame.f_back, &next, frame_snapshot_size };
+        return mem.TryReadV(chunks, frame.f_back ? 3 : 2);
+    }
+
+    // A spliced frame is the same frame object as in the previous sample, but it
+    // kept running meanwhile; CPython 2.7 even hands the finished frame of a code
+    // object to its next call at the same address. The position of every spliced
+    // frame is read again in one vectored read, f_lasti and f_lineno are adjacent.
+    // Returns the number of frames whose position changed.
+    static read_result<std::size_t> RefreshPositions(RemoteMemory& mem, raw_pyframe* frames, std::size_t n_frames)
+    {
+        static_assert(offsetof(PyFrameObject, f_lineno) == offsetof(PyFrameObject, f_lasti) + sizeof(int),
+            "f_lasti and f_lineno are read as one chunk");
+        struct frame_position
+        {
+            int lasti_lineno[2];
+            void* trace;
+        };
+        std::vector<frame_position> positions(n_frames);
+        std::vector<remote_chunk> chunks;
+        chunks.reserve(2 * n_frames);
+        for (std::size_t i = 0; i < n_frames; i++) {
+            chunks.push_back({ frames[i].addr + offsetof(PyFrameObject, f_lasti), positions[i].lasti_lineno, sizeof(positions[i].lasti_lineno) });
+            chunks.push_back({ frames[i].addr + offsetof(PyFrameObject, f_trace), &positions[i].trace, sizeof(positions[i].trace) });
+        }
+        const auto read = mem.TryReadV(chunks.data(), chunks.size());
+        if (!read) {
+            return tl::make_unexpected(read.error());
+        }
+        std::size_t changed = 0;
+        for (std::size_t i = 0; i < n_frames; i++) {
+            const int lasti = positions[i].lasti_lineno[0];
+            const int lineno = positions[i].trace ? positions[i].lasti_lineno[1] : -1;
+            if (frames[i].lasti != lasti || frames[i].lineno != lineno) {
+                frames[i].lasti = lasti;
+                frames[i].lineno = lineno;
+                changed++;
             }
         }
-        return 0;
+        return changed;
     }
-    void* StringSize(void* addr)
+
+    // Line of a frame captured as raw, see GetLine.
+    static size_t RawLine(const raw_pyframe& raw, const code_info& code)
     {
-        return addr + offsetof(PyStringObject, ob_size);
+        return raw.lineno >= 0 ? static_cast<size_t>(raw.lineno) : code.Line(raw.lasti & std::numeric_limits<int>::max());
     }
 
-    void* ByteData(void* addr)
+    // A walk fails with EINVAL at a frame whose f_code is not a code object.
+    [[noreturn]] static void throw_walk_error(RemoteMemory& mem, const read_error& error)
     {
-        return addr + offsetof(PyStringObject, ob_sval);
+        if (error.err == EINVAL) {
+            std::ostringstream ss;
+            ss << "Frame refers to " << error.addr << " which is not a valid code or string object";
+            throw PtraceException(ss.str());
+        }
+        throw_read_error(mem.pid(), error);
+    }
+
+    // This is essentially an implementation of PyFrame_GetLineNumber, the line
+    // table of the code object is decoded by code_info::Line.
+    size_t GetLine(const PyFrameObject& frame, const code_info& code)
+    {
+        if (frame.f_trace) {
+            return static_cast<size_t>(frame.f_lineno & std::numeric_limits<decltype(_frame::f_lineno)>::max());
+        }
+        return code.Line(frame.f_lasti & std::numeric_limits<int>::max());
     }
 
-    std::string StringData(pid_t pid, void* addr)
+    int thread_chain::Match(void* addr, void* code, void* f_back) const
     {
-        return ptrace_peek_string(pid, ByteData(addr));
+        auto iter = positions.find(addr);
+        if (iter == positions.end()) {
+            return -1;
+        }
+        const std::uint32_t pos = iter->second;
+        void* cached_back = pos + 1 < frames.size() ? frames[pos + 1].addr : nullptr;
+        if (frames[pos].code != code || cached_back != f_back) {
+            return -1;
+        }
+        return static_cast<int>(pos);
     }
 
+    const thread_chain* ChainCache::Find(void* thread_id) const
+    {
+        auto iter = chains_.find(thread_id);
+        return iter == chains_.end() ? nullptr : &iter->second;
+    }
 
-    // Extract the line number from the code object. Python uses a compressed table
-    // data structure to store line numbers. See:
-    //
-    // https://svn.python.org/projects/python/trunk/Objects/lnotab_notes.txt
-    //
-    // This is essentially an implementation of PyFrame_GetLineNumber /
-    // PyCode_Addr2Line.
-    size_t GetLine(pid_t pid, void* frame, void* f_code)
+    void ChainCache::Store(void* thread_id, thread_chain&& chain)
     {
-        const long f_trace = ptrace_peek(pid, frame + offsetof(_frame, f_trace));
-        if (f_trace) {
-            return static_cast<size_t>(
-                ptrace_peek(pid, (frame + offsetof(_frame, f_lineno))) &
-                std::numeric_limits<decltype(_frame::f_lineno)>::max());
+        chain.positions.clear();
+        for (std::uint32_t i = 0; i < chain.frames.size(); i++) {
+            chain.positions[chain.frames[i].addr] = i;
         }
+        next_chains_[thread_id] = std::move(chain);
+    }
 
-        const int f_lasti = ptrace_peek(pid, (frame + offsetof(_frame, f_lasti))) &
-            std::numeric_limits<int>::max();
-        void* co_lnotab = (void*)
-            ptrace_peek(pid, (f_code + offsetof(PyCodeObject, co_lnotab)));
+    void ChainCache::EndSample()
+    {
+        chains_.swap(next_chains_);
+        next_chains_.clear();
+    }
 
-        int size =
-            ptrace_peek(pid, (void*)(StringSize(co_lnotab))) & std::numeric_limits<int>::max();
-        int line = ptrace_peek(pid, (f_code + offsetof(PyCodeObject, co_firstlineno))) &
-            std::numeric_limits<int>::max();
-        const std::unique_ptr<uint8_t[]> tbl =
-            ptrace_peek_bytes(pid, (void*)(ByteData(co_lnotab)), size);
-        size /= 2;  // since we increment twice in each loop iteration
-        const uint8_t* p = tbl.get();
-        int addr = 0;
-        while (--size >= 0) {
-            addr += *p++;
-            if (addr > f_lasti) {
-                break;
+    // Resolve the chain starting at frame_addr into out, splicing in the tail of
+    // previous at the first matching frame. Returns the number of spliced frames.
+    read_result<std::size_t> walk_py_frames(RemoteMemory& mem, void* frame_addr, CodeCache& codes,
+        const thread_chain* previous, thread_chain& out)
+    {
+        // only chains resolved by an earlier walk can be spliced here
+        if (previous != nullptr && previous->resolved.size() != previous->frames.size()) {
+            previous = nullptr;
+        }
+        PyFrameObject frame;
+        PyFrameObject next_frame;
+        code_header code_head;
+        const auto first = mem.TryRead(frame_addr, &frame, frame_snapshot_size);
+        if (!first) {
+            return tl::make_unexpected(first.error());
+        }
+        while (true)
+        {
+            const int matched = previous ? previous->Match(frame_addr, frame.f_code, frame.f_back) : -1;
+            read_result<const code_info*> code;
+            if (matched >= 0) {
+                code = codes.TryGet(mem, frame.f_code);
+            }
+            else {
+                const auto step = ReadStep(mem, frame, code_head, next_frame);
+                if (!step) {
+                    return tl::make_unexpected(step.error());
+                }
+                code = codes.TryGet(mem, frame.f_code, code_head);
+            }
+            if (!code) {
+                return tl::make_unexpected(code.error());
+            }
+            if (*code == nullptr) {
+                return read_failure(EINVAL, frame.f_code);
+            }
+            const int lineno = frame.f_trace ? frame.f_lineno : -1;
+            out.frames.push_back({ frame_addr, frame.f_code, frame.f_lasti, lineno });
+            out.resolved.push_back({ frame_addr, codes.strings().Str((*code)->file_id), codes.strings().Str((*code)->name_id), GetLine(frame, **code) });
+            if (matched >= 0) {
+                const std::size_t first = out.frames.size();
+                out.frames.insert(out.frames.end(), previous->frames.begin() + matched + 1, previous->frames.end());
+                out.resolved.insert(out.resolved.end(), previous->resolved.begin() + matched + 1, previous->resolved.end());
+                const auto changed = RefreshPositions(mem, out.frames.data() + first, out.frames.size() - first);
+                if (!changed) {
+                    return tl::make_unexpected(changed.error());
+                }
+                for (std::size_t i = first; *changed && i < out.frames.size(); i++) {
+                    const raw_pyframe& cached = previous->frames[matched + 1 + i - first];
+                    if (out.frames[i].lasti == cached.lasti && out.frames[i].lineno == cached.lineno) {
+                        continue;
+                    }
+                    const auto spliced_code = codes.TryGet(mem, out.frames[i].code);
+                    if (!spliced_code) {
+                        return tl::make_unexpected(spliced_code.error());
+                    }
+                    if (*spliced_code == nullptr) {
+                        return read_failure(EINVAL, out.frames[i].code);
+                    }
+                    out.resolved[i].line = RawLine(out.frames[i], **spliced_code);
+                }
+                return previous->frames.size() - matched - 1;
+            }
+            if (frame.f_back == nullptr) {
+                return 0;
             }
-            line += *p++;
+            frame_addr = frame.f_back;
+            memcpy(&frame, &next_frame, frame_snapshot_size);
         }
-        return static_cast<size_t>(line);
     }
 
-    pyframes_t trace_py_frames(pid_t pid, void* frame_addr)
+    read_result<pyframes_t> try_trace_py_frames(RemoteMemory& mem, void* frame_addr, CodeCache* codes)
     {
-        void* f_back = nullptr;
-        pyframes_t result;
-        do
-        {
-            void* f_code = ptrace_peek_ptr(pid, frame_addr + offsetof(_frame, f_code));
-            auto co_filename = ptrace_peek_ptr(pid, f_code + offsetof(PyCodeObject, co_filename));
-            std::string filename = StringData(pid, co_filename);
-            std::string name = StringData(pid, ptrace_peek_ptr(pid, f_code + offsetof(PyCodeObject, co_name)));
-            result.push_back({ frame_addr, filename, name, GetLine(pid, frame_addr , f_code) });
-            f_back = ptrace_peek_ptr(pid, frame_addr + offsetof(_frame, f_back));
-            frame_addr = f_back;
+        // without a long lived cache the code objects are still shared within this walk
+        CodeCache local_codes(nullptr);
+        thread_chain chain;
+        const auto walked = walk_py_frames(mem, frame_addr, codes ? *codes : local_codes, nullptr, chain);
+        if (!walked) {
+            return tl::make_unexpected(walked.error());
         }
-        while (frame_addr);
-        return result;
+        return std::move(chain.resolved);
     }
 
-    std::vector<py_thread> trace_py_threads(pid_t pid, PyAddresses addrs, bool enable_py_threads)
+    pyframes_t trace_py_frames(RemoteMemory& mem, void* frame_addr, CodeCache* codes)
+    {
+        auto frames = try_trace_py_frames(mem, frame_addr, codes);
+        if (!frames) {
+            throw_walk_error(mem, frames.error());
+        }
+        return std::move(*frames);
+    }
+
+    // Find the head of the thread state list, current_tstate is set to the thread
+    // holding the GIL.
+    read_result<void*> try_first_tstate(RemoteMemory& mem, const PyAddresses& addrs, bool enable_py_threads,
+        void** current_tstate)
     {
         // Pointer to the current interpreter state. Python has a very rarely used
       // feature called "sub-interpreters", Pyflame only supports profiling a single
@@ -128,13 +248,19 @@ namespace spiritsaway::cpy_frame
         // First try to get interpreter state via dereferencing
         // _Pypy_threadState_Current. This won't work if the main py_thread doesn't hold
         // the GIL (_Current will be null).
-        void* tstate = ptrace_peek_ptr(pid, addrs.tstate_addr);
-        std::cout << "tstate phase 1 " << tstate << std::endl;
-        void* current_tstate = tstate;
+        auto tstate_read = mem.TryReadPtr(addrs.tstate_addr);
+        if (!tstate_read) {
+            return tstate_read;
+        }
+        void* tstate = *tstate_read;
+        *current_tstate = tstate;
         if (enable_py_threads) {
             if (tstate != nullptr) {
-                istate = ptrace_peek_ptr(pid, tstate + offsetof(PyThreadState, interp));
-                std::cout << "istate phase 1" << istate << std::endl;
+                const auto istate_read = mem.TryReadPtr(tstate + offsetof(PyThreadState, interp));
+                if (!istate_read) {
+                    return istate_read;
+                }
+                istate = *istate_read;
                 // Secondly try to get it via the static interp_head symbol, if we managed
                 // to find it:
                 //  - interp_head is not strictly speaking part of the public API so it
@@ -143,63 +269,369 @@ namespace spiritsaway::cpy_frame
                 //    will drop it
             }
             else if (addrs.interp_head_addr != nullptr) {
-                istate =
-                    ptrace_peek_ptr(pid, addrs.interp_head_addr);
-                std::cout << "istate phase 2" << istate << std::endl;
-
+                const auto istate_read = mem.TryReadPtr(addrs.interp_head_addr);
+                if (!istate_read) {
+                    return istate_read;
+                }
+                istate = *istate_read;
             }
             else if (addrs.interp_head_hint != nullptr) {
                 // Finally. check if we have already put a hint into interp_head_hint -
                 // currently this can only happen if we called PyInterpreterState_Head.
                 istate = addrs.interp_head_hint;
-                std::cout << "istate phase 3" << istate << std::endl;
-
             }
             if (istate != nullptr) {
-                tstate = ptrace_peek_ptr(pid, istate + offsetof(PyInterpreterState, tstate_head));
-                std::cout << "tstate phase 2 " << tstate << std::endl;
-
+                tstate_read = mem.TryReadPtr(istate + offsetof(PyInterpreterState, tstate_head));
+                if (!tstate_read) {
+                    return tstate_read;
+                }
+                tstate = *tstate_read;
             }
         }
+        return tstate;
+    }
+
+    void* first_tstate(RemoteMemory& mem, const PyAddresses& addrs, bool enable_py_threads, void** current_tstate)
+    {
+        const auto tstate = try_first_tstate(mem, addrs, enable_py_threads, current_tstate);
+        if (!tstate) {
+            throw_read_error(mem.pid(), tstate.error());
+        }
+        return *tstate;
+    }
+
+    read_result<std::vector<py_thread>> try_trace_py_threads(RemoteMemory& mem, PyAddresses addrs,
+        bool enable_py_threads, CodeCache* codes, ChainCache* chains)
+    {
+        CodeCache local_codes(addrs.code_type_addr, addrs.string_type_addr);
+        CodeCache& code_cache = codes ? *codes : local_codes;
+        void* current_tstate = nullptr;
+        const auto head = try_first_tstate(mem, addrs, enable_py_threads, &current_tstate);
+        if (!head) {
+            return tl::make_unexpected(head.error());
+        }
+        void* tstate = *head;
 
         // Walk the py_thread list.
         std::vector<py_thread> py_threads;
-        std::cout << "trace thread tstate " << tstate << std::endl;
-
         while (tstate != nullptr) {
-            std::cout << "trace thread tstate " << tstate << std::endl;
-            void* id =
-                ptrace_peek_ptr(pid, tstate + offsetof(PyThreadState, thread_id));
+            // thread id, current frame and next thread state in one scatter read
+            void* id = nullptr;
+            void* frame_addr = nullptr;
+            void* next = nullptr;
+            remote_chunk tstate_fields[] = {
+                { tstate + offsetof(PyThreadState, thread_id), &id, sizeof(id) },
+                { tstate + offsetof(PyThreadState, frame), &frame_addr, sizeof(frame_addr) },
+                { tstate + offsetof(PyThreadState, next), &next, sizeof(next) },
+            };
+            const auto fields = mem.TryReadV(tstate_fields, sizeof(tstate_fields) / sizeof(tstate_fields[0]));
+            if (!fields) {
+                return tl::make_unexpected(fields.error());
+            }
             const bool is_current = tstate == current_tstate;
 
-            // Dereference the py_thread's current frame.
-            std::cout << "trace thread step 2" << std::endl;
-            auto frame_addr = ptrace_peek_ptr(pid, tstate + offsetof(PyThreadState, frame));
-
             if (frame_addr != nullptr) {
-                std::cout << "trace thread step 3" << std::endl;
-
-                py_threads.push_back({ id, is_current, trace_py_frames(pid, frame_addr) });
+                thread_chain chain;
+                const thread_chain* previous = chains ? chains->Find(id) : nullptr;
+                const auto walked = walk_py_frames(mem, frame_addr, code_cache, previous, chain);
+                if (!walked) {
+                    return tl::make_unexpected(walked.error());
+                }
+                const std::size_t reused = *walked;
+                py_threads.push_back({ id, is_current, chain.resolved });
+                if (chains) {
+                    chains->CountFrames(chain.frames.size() - reused, reused);
+                    chains->Store(id, std::move(chain));
+                }
             }
-            std::cout << "trace thread step 4" << std::endl;
-
             if (enable_py_threads) {
-                tstate = ptrace_peek_ptr(pid, tstate + offsetof(PyThreadState, next));
+                tstate = next;
             }
             else {
                 tstate = nullptr;
             }
         };
+        if (chains) {
+            chains->EndSample();
+        }
 
         return py_threads;
     }
 
+    std::vector<py_thread> trace_py_threads(RemoteMemory& mem, PyAddresses addrs, bool enable_py_threads,
+        CodeCache* codes, ChainCache* chains)
+    {
+        auto py_threads = try_trace_py_threads(mem, addrs, enable_py_threads, codes, chains);
+        if (!py_threads) {
+            throw_walk_error(mem, py_threads.error());
+        }
+        return std::move(*py_threads);
+    }
+
+    // Walk the frame chain of a thread that keeps running while we read it. Every
+    // frame has to be a PyFrame_Type object pointing at a PyCode_Type object and
+    // the f_back chain may neither loop nor exceed max_depth. Returns false when
+    // the chain was torn by the target, result then holds the frames read so far.
+    bool trace_py_frames_checked(RemoteMemory& mem, const PyAddresses& addrs, CodeCache& codes,
+        void* frame_addr, std::size_t max_depth, pyframes_t& result)
+    {
+        std::unordered_set<void*> visited;
+        PyFrameObject frame;
+        PyFrameObject next_frame;
+        code_header code_head;
+        // a failed read means the chain pointed into memory that was released
+        // meanwhile, which is routine here and must not cost an exception
+        if (!mem.TryRead(frame_addr, &frame, frame_snapshot_size))
+        {
+            return false;
+        }
+        while (true)
+        {
+            if (result.size() >= max_depth || !visited.insert(frame_addr).second)
+            {
+                return false;
+            }
+            if (frame.f_code == nullptr || (addrs.frame_type_addr && Py_TYPE(&frame) != addrs.frame_type_addr))
+            {
+                return false;
+            }
+            if (!ReadStep(mem, frame, code_head, next_frame))
+            {
+                return false;
+            }
+            const auto code = codes.TryGet(mem, frame.f_code, code_head);
+            if (!code || *code == nullptr)
+            {
+                return false;
+            }
+            result.push_back({ frame_addr, codes.strings().Str((*code)->file_id), codes.strings().Str((*code)->name_id), GetLine(frame, **code) });
+            if (frame.f_back == nullptr)
+            {
+                return true;
+            }
+            frame_addr = frame.f_back;
+            memcpy(&frame, &next_frame, frame_snapshot_size);
+        }
+    }
+
+    std::vector<py_thread> trace_py_threads_nonstop(RemoteMemory& mem, PyAddresses addrs,
+        bool enable_py_threads, std::size_t max_retries, CodeCache* codes)
+    {
+        CodeCache local_codes(addrs.code_type_addr, addrs.string_type_addr);
+        CodeCache& code_cache = codes ? *codes : local_codes;
+        void* current_tstate = nullptr;
+        std::vector<py_thread> py_threads;
+        const auto head = try_first_tstate(mem, addrs, enable_py_threads, &current_tstate);
+        if (!head) {
+            // the interpreter is not set up yet or being torn down, nothing to sample
+            return py_threads;
+        }
+        void* tstate = *head;
+        // a list freed and reused under us may loop back on itself
+        std::unordered_set<void*> visited;
+        while (tstate != nullptr && visited.size() < MAX_NONSTOP_THREADS && visited.insert(tstate).second) {
+            void* id = nullptr;
+            void* frame_addr = nullptr;
+            void* next = nullptr;
+            remote_chunk tstate_fields[] = {
+                { tstate + offsetof(PyThreadState, thread_id), &id, sizeof(id) },
+                { tstate + offsetof(PyThreadState, frame), &frame_addr, sizeof(frame_addr) },
+                { tstate + offsetof(PyThreadState, next), &next, sizeof(next) },
+            };
+            if (!mem.TryReadV(tstate_fields, sizeof(tstate_fields) / sizeof(tstate_fields[0]))) {
+                // the thread state was freed under us, the rest of the list is lost
+                break;
+            }
+
+            py_thread this_thread{ id, tstate == current_tstate, {}, false };
+            for (std::size_t attempt = 0; frame_addr != nullptr && attempt <= max_retries; attempt++) {
+                pyframes_t frames;
+                // every attempt gets a fresh page cache, pages cached by a torn walk
+                // must not leak into the retry
+                PageCache attempt_cache(mem);
+                bool ok = trace_py_frames_checked(attempt_cache, addrs, code_cache, frame_addr, MAX_NONSTOP_DEPTH, frames);
+                // the thread must still be in the frame we started from, otherwise
+                // the outer part of the chain may belong to another call
+                const auto frame_read = mem.TryReadPtr(tstate + offsetof(PyThreadState, frame));
+                void* frame_now = frame_read.value_or(nullptr);
+                ok = ok && frame_read.has_value();
+                if (ok && frame_now == frame_addr) {
+                    this_thread.frames = std::move(frames);
+                    this_thread.consistent = true;
+                    break;
+                }
+                if (frames.size() >= this_thread.frames.size()) {
+                    this_thread.frames = std::move(frames);
+                }
+                frame_addr = frame_now;
+            }
+            if (!this_thread.frames.empty()) {
+                py_threads.push_back(std::move(this_thread));
+            }
+            tstate = enable_py_threads ? next : nullptr;
+        }
+        return py_threads;
+    }
+
+    read_result<std::size_t> try_capture_py_frames(RemoteMemory& mem, void* frame_addr,
+        std::vector<raw_pyframe>& frames, const thread_chain* previous)
+    {
+        PyFrameObject frame;
+        while (frame_addr) {
+            const auto frame_read = mem.TryRead(frame_addr, &frame, frame_snapshot_size);
+            if (!frame_read) {
+                return tl::make_unexpected(frame_read.error());
+            }
+            const int lineno = frame.f_trace ? frame.f_lineno : -1;
+            frames.push_back({ frame_addr, frame.f_code, frame.f_lasti, lineno });
+            const int matched = previous ? previous->Match(frame_addr, frame.f_code, frame.f_back) : -1;
+            if (matched >= 0) {
+                const std::size_t first = frames.size();
+                frames.insert(frames.end(), previous->frames.begin() + matched + 1, previous->frames.end());
+                const auto changed = RefreshPositions(mem, frames.data() + first, frames.size() - first);
+                if (!changed) {
+                    return tl::make_unexpected(changed.error());
+                }
+                return previous->frames.size() - matched - 1;
+            }
+            frame_addr = frame.f_back;
+        }
+        return 0;
+    }
+
+    std::size_t capture_py_frames(RemoteMemory& mem, void* frame_addr, std::vector<raw_pyframe>& frames,
+        const thread_chain* previous)
+    {
+        const auto reused = try_capture_py_frames(mem, frame_addr, frames, previous);
+        if (!reused) {
+            throw_read_error(mem.pid(), reused.error());
+        }
+        return *reused;
+    }
+
+    read_result<raw_sample> try_capture_py_threads(RemoteMemory& mem, PyAddresses addrs, bool enable_py_threads,
+        ChainCache* chains)
+    {
+        void* current_tstate = nullptr;
+        const auto head = try_first_tstate(mem, addrs, enable_py_threads, &current_tstate);
+        if (!head) {
+            return tl::make_unexpected(head.error());
+        }
+        void* tstate = *head;
+        raw_sample sample;
+        while (tstate != nullptr) {
+            void* id = nullptr;
+            void* frame_addr = nullptr;
+            void* next = nullptr;
+            remote_chunk tstate_fields[] = {
+                { tstate + offsetof(PyThreadState, thread_id), &id, sizeof(id) },
+                { tstate + offsetof(PyThreadState, frame), &frame_addr, sizeof(frame_addr) },
+                { tstate + offsetof(PyThreadState, next), &next, sizeof(next) },
+            };
+            const auto fields = mem.TryReadV(tstate_fields, sizeof(tstate_fields) / sizeof(tstate_fields[0]));
+            if (!fields) {
+                return tl::make_unexpected(fields.error());
+            }
+            if (frame_addr != nullptr) {
+                const auto first_frame = static_cast<std::uint32_t>(sample.frames.size());
+                const thread_chain* previous = chains ? chains->Find(id) : nullptr;
+                const auto reused = try_capture_py_frames(mem, frame_addr, sample.frames, previous);
+                if (!reused) {
+                    return tl::make_unexpected(reused.error());
+                }
+                const auto n_frames = static_cast<std::uint32_t>(sample.frames.size()) - first_frame;
+                sample.threads.push_back({ id, tstate == current_tstate, first_frame, n_frames });
+                if (chains) {
+                    thread_chain chain;
+                    chain.frames.assign(sample.frames.begin() + first_frame, sample.frames.end());
+                    chains->CountFrames(n_frames - *reused, *reused);
+                    chains->Store(id, std::move(chain));
+                }
+            }
+            tstate = enable_py_threads ? next : nullptr;
+        }
+        if (chains) {
+            chains->EndSample();
+        }
+        return sample;
+    }
+
+    raw_sample capture_py_threads(RemoteMemory& mem, PyAddresses addrs, bool enable_py_threads,
+        ChainCache* chains)
+    {
+        auto sample = try_capture_py_threads(mem, addrs, enable_py_threads, chains);
+        if (!sample) {
+            throw_read_error(mem.pid(), sample.error());
+        }
+        return std::move(*sample);
+    }
+
+    // Resolve one captured frame into string ids, code objects freed since the
+    // capture resolve to "<unknown>".
+    interned_pyframe InternFrame(RemoteMemory& mem, CodeCache& codes, const raw_pyframe& raw)
+    {
+        // fails if the code object was freed after the capture
+        const auto code = codes.TryGet(mem, raw.code);
+        if (!code || *code == nullptr) {
+            const std::uint32_t unknown = codes.strings().Intern("<unknown>");
+            return { unknown, unknown, 0 };
+        }
+        const code_info& info = **code;
+        return { info.file_id, info.name_id, static_cast<std::uint32_t>(RawLine(raw, info)) };
+    }
+
+    std::vector<interned_py_thread> symbolize_py_threads_interned(RemoteMemory& mem, CodeCache& codes,
+        const raw_sample& sample)
+    {
+        std::vector<interned_py_thread> py_threads;
+        py_threads.reserve(sample.threads.size());
+        for (const auto& raw_thread : sample.threads) {
+            interned_py_thread this_thread{ raw_thread.id, raw_thread.is_current, {} };
+            this_thread.frames.reserve(raw_thread.n_frames);
+            for (std::uint32_t i = 0; i < raw_thread.n_frames; i++) {
+                this_thread.frames.push_back(InternFrame(mem, codes, sample.frames[raw_thread.first_frame + i]));
+            }
+            py_threads.push_back(std::move(this_thread));
+        }
+        return py_threads;
+    }
+
+    std::vector<py_thread> symbolize_py_threads(RemoteMemory& mem, CodeCache& codes, const raw_sample& sample)
+    {
+        const StringTable& strings = codes.strings();
+        std::vector<py_thread> py_threads;
+        py_threads.reserve(sample.threads.size());
+        for (const auto& raw_thread : sample.threads) {
+            py_thread this_thread{ raw_thread.id, raw_thread.is_current, {} };
+            this_thread.frames.reserve(raw_thread.n_frames);
+            for (std::uint32_t i = 0; i < raw_thread.n_frames; i++) {
+                const raw_pyframe& raw = sample.frames[raw_thread.first_frame + i];
+                const interned_pyframe frame = InternFrame(mem, codes, raw);
+                this_thread.frames.push_back({ raw.addr, strings.Str(frame.file), strings.Str(frame.name), frame.line });
+            }
+            py_threads.push_back(std::move(this_thread));
+        }
+        return py_threads;
+    }
+
+    pyframes_t trace_py_frames(pid_t pid, void* frame_addr)
+    {
+        auto mem = RemoteMemory::Probe(pid, frame_addr);
+        return trace_py_frames(*mem, frame_addr);
+    }
+
+    std::vector<py_thread> trace_py_threads(pid_t pid, PyAddresses addrs, bool enable_py_threads)
+    {
+        auto mem = RemoteMemory::Probe(pid, addrs.tstate_addr);
+        return trace_py_threads(*mem, addrs, enable_py_threads);
+    }
+
     // locate within libpython
-    PyAddresses AddressesFromLibPython(pid_t pid, const std::string& libpython,
+    PyAddresses AddressesFromLibPython(const MemoryMap& maps, const std::string& libpython,
         Namespace* ns, PyABI* abi)
     {
         std::string elf_path;
-        const size_t offset = locate_lib_python(pid, libpython, elf_path);
+        const size_t offset = maps.ModuleBase(libpython, &elf_path);
         if (offset == 0) {
             std::ostringstream ss;
             ss << "Failed to locate libpython named " << libpython;
@@ -208,7 +640,6 @@ namespace spiritsaway::cpy_frame
 
         ELF pyelf;
         pyelf.Open(elf_path, ns);
-        pyelf.Parse();
         const PyAddresses addrs = pyelf.GetAddresses(abi);
         if (addrs.empty()) {
             throw SymbolException("Failed to locate addresses");
@@ -216,14 +647,13 @@ namespace spiritsaway::cpy_frame
         return addrs + offset;
     }
 
-    PyAddresses Addrs(pid_t pid, Namespace* ns, PyABI* abi)
+    PyAddresses Addrs(pid_t pid, const MemoryMap& maps, Namespace* ns, PyABI* abi)
     {
         std::ostringstream ss;
         ss << "/proc/" << pid << "/exe";
         ELF target;
         std::string exe = ReadLink(ss.str().c_str());
         target.Open(exe, ns);
-        target.Parse();
 
         // There's two different cases here. The default way Python is compiled you
         // get a "static" build which means that you get a big several-megabytes
@@ -247,9 +677,7 @@ namespace spiritsaway::cpy_frame
         if (addrs) {
             if (addrs.pie) {
                 // If Python executable is PIE, add offsets
-                std::string elf_path;
-                const size_t offset = locate_lib_python(pid, exe, elf_path);
-                return addrs + offset;
+                return addrs + maps.ModuleBase(exe);
             }
             else {
                 return addrs;
@@ -264,43 +692,56 @@ namespace spiritsaway::cpy_frame
             }
         }
         if (!libpython.empty()) {
-            return AddressesFromLibPython(pid, libpython, ns, abi);
+            return AddressesFromLibPython(maps, libpython, ns, abi);
         }
         // A process like uwsgi may use dlopen() to load libpython... let's just guess
         // that the DSO is called libpython2.7.so
         //
         // XXX: this won't work if the embedding language is Python 3
-        return AddressesFromLibPython(pid, "libpython2.7.so", ns, abi);
+        return AddressesFromLibPython(maps, "libpython2.7.so", ns, abi);
     }
 
-    int set_addrs_(pid_t pid_, PyABI* abi, PyAddresses& addrs_)
+    int set_addrs_(pid_t pid_, const MemoryMap& maps, PyABI* abi, PyAddresses& addrs_)
     {
         Namespace ns(pid_);
         try {
-            addrs_ = Addrs(pid_, &ns, abi);
+            addrs_ = Addrs(pid_, maps, &ns, abi);
         }
         catch (const SymbolException& exc) {
             return 1;
         }
+        return 0;
+    }
+
+    // interp_head is not part of the dynamic symbol table, so e.g. strip drops it.
+    // Scan the interpreter's data for it, and only if that fails call
+    // PyInterpreterState_Head in the target. That needs a stopped target, so it
+    // is skipped in non-stop mode.
+    static void resolve_interp_head(pid_t pid, const MemoryMap& maps, bool non_stop, RemoteCaller* caller,
+        PyAddresses& addrs_)
+    {
 #if ENABLE_THREADS
-        // If we didn't find the interp_head address, but we did find the public
-        // PyInterpreterState_Head
-        // function, use evil non-portable ptrace tricks to call the function
-        if (addrs_.interp_head_addr == 0 &&
-            addrs_.interp_head_hint == 0 && addrs_.interp_head_fn_addr != 0) {
-            addrs_.interp_head_hint =
-               (void*)(ptrace_call_function(pid_, (long)addrs_.interp_head_fn_addr));
+        if (addrs_.interp_head_addr != 0 || addrs_.interp_head_hint != 0) {
+            return;
+        }
+        auto mem = RemoteMemory::Probe(pid, addrs_.tstate_addr);
+        addrs_.interp_head_addr = locate_interp_head(*mem, maps, addrs_);
+        if (!non_stop && addrs_.interp_head_addr == 0 && addrs_.interp_head_fn_addr != 0) {
+            RemoteCaller local_caller(pid);
+            RemoteCaller& one_caller = caller ? *caller : local_caller;
+            addrs_.interp_head_hint = (void*)one_caller.Call(addrs_.interp_head_fn_addr);
+            // no page of ours stays in the target for the rest of the session
+            one_caller.Release();
         }
 #endif
-        return 0;
     }
 
-    int detect_python_abi(PyABI abi, PyAddresses& addrs_, pid_t pid)
+    int detect_python_abi(PyABI abi, PyAddresses& addrs_, pid_t pid, const MemoryMap& maps)
     {
         // Set up the function pointers. By default, we auto-detect the ABI. If an ABI
      // is explicitly passed to us, then use that one (even though it could be
      // wrong)!
-        if (set_addrs_(pid, abi == PyABI::Unknown ? &abi : nullptr, addrs_)) {
+        if (set_addrs_(pid, maps, abi == PyABI::Unknown ? &abi : nullptr, addrs_)) {
             return 1;
         }
         if (abi != PyABI::Py26)
@@ -313,47 +754,131 @@ namespace spiritsaway::cpy_frame
         return 0;
     }
 
-    std::vector<py_thread> dump_py_threads(pid_t pid, bool enable_py_threads)
+    // Everything the symbol lookup depends on: the executable and the mapped
+    // libpython files. The lookup can only succeed after this changes.
+    static std::string python_candidates(pid_t pid, const MemoryMap& maps)
     {
-
-        if (ptrace(PTRACE_SEIZE, pid, 0, 0))
+        std::ostringstream ss;
+        ss << "/proc/" << pid << "/exe";
+        std::string candidates = ReadLink(ss.str().c_str());
+        const std::string* last = nullptr;
+        for (const auto& one_mapping : maps.mappings())
         {
-            std::cerr << "Failed to seize PID " << pid << std::endl;
-            throw PtraceException("fail to PTRACE_SEIZE");
+            if (one_mapping.path.find("libpython") == std::string::npos ||
+                (last && *last == one_mapping.path))
+            {
+                continue;
+            }
+            last = &one_mapping.path;
+            candidates += '\n';
+            candidates += one_mapping.path;
         }
-        if (ptrace(PTRACE_INTERRUPT, pid, 0, 0))
+        return candidates;
+    }
+
+    PyAddresses attach_python(pid_t pid, bool non_stop, PyABI* detected_abi, RemoteCaller* caller)
+    {
+        // in non-stop mode the target is never seized, the stacks are read while
+        // it keeps running
+        if (!non_stop)
         {
-            std::cerr << "fail to PTRACE_INTERRUPT" << pid << std::endl;
-            throw PtraceException("fail to PTRACE_INTERRUPT ");
+            if (ptrace(PTRACE_SEIZE, pid, 0, 0))
+            {
+                std::cerr << "Failed to seize PID " << pid << std::endl;
+                throw PtraceException("fail to PTRACE_SEIZE");
+            }
+            std::cerr << "suc ptrace target process" << std::endl;
         }
-        std::cout << "suc ptrace target process" << std::endl;
-        PyABI abi;
+        // the target keeps running while its maps are polled, the symbols are
+        // looked up again only once the executable or a libpython mapping changed
+        const auto wait_start = std::chrono::steady_clock::now();
+        const auto deadline = wait_start + std::chrono::milliseconds(MAX_ATTACH_WAIT_MS);
         PyAddresses addrs;
-        int max_retry = 50;
-        int i = 0;
-        for (; i < max_retry; i++)
+        int lookups = 0;
+        try
         {
-            if (detect_python_abi(abi, addrs, pid))
+            MemoryMap maps(pid);
+            std::string candidates = python_candidates(pid, maps);
+            for (lookups = 1; detect_python_abi(PyABI::Unknown, addrs, pid, maps); lookups++)
             {
-                if (i == max_retry - 1)
+                std::string current = candidates;
+                auto interval = std::chrono::milliseconds(ATTACH_POLL_INTERVAL_MS);
+                while (current == candidates)
                 {
-                    throw PtraceException("fail to detect python abi with max retry");
-
+                    const auto now = std::chrono::steady_clock::now();
+                    if (now >= deadline)
+                    {
+                        throw PtraceException("fail to detect python abi before the attach deadline");
+                    }
+                    std::this_thread::sleep_until(std::min(now + interval, deadline));
+                    interval = std::min(interval * 2, std::chrono::milliseconds(ATTACH_POLL_MAX_INTERVAL_MS));
+                    if (!non_stop)
+                    {
+                        ptrace_pass_signals(pid);
+                    }
+                    if (maps.Refresh())
+                    {
+                        current = python_candidates(pid, maps);
+                    }
                 }
-                ptrace_condition(pid);
-                std::this_thread::sleep_for(std::chrono::milliseconds(100));
-                ptrace_interrupt(pid);
-
+                candidates.swap(current);
             }
-            else
+            if (!non_stop)
             {
-                break;
+                ptrace_stop(pid);
+            }
+            resolve_interp_head(pid, maps, non_stop, caller, addrs);
+        }
+        catch (const std::runtime_error&)
+        {
+            // do not leave the target seized behind
+            if (!non_stop)
+            {
+                try
+                {
+                    ptrace_stop(pid);
+                    ptrace_detach(pid);
+                }
+                catch (const std::runtime_error&)
+                {
+                }
             }
+            throw;
+        }
+        const auto wait_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now() - wait_start).count();
+        std::cerr << "suc to detect target python abi after " << lookups << " lookups in " << wait_ms << "ms" << std::endl;
+        std::cerr << addrs << std::endl;
+        if (detected_abi)
+        {
+            // detect_python_abi rejects everything but py2.7
+            *detected_abi = PyABI::Py26;
+        }
+        return addrs;
+    }
 
+    bool try_resolve_python(pid_t pid, const MemoryMap& maps, RemoteCaller* caller, std::string& candidates,
+        PyAddresses& addrs)
+    {
+        std::string current = python_candidates(pid, maps);
+        if (current == candidates)
+        {
+            return false;
+        }
+        candidates.swap(current);
+        PyAddresses found;
+        if (detect_python_abi(PyABI::Unknown, found, pid, maps))
+        {
+            return false;
         }
-        std::cout << "suc to detect target python abi with iteration " <<i<< std::endl;
-        std::cout << addrs << std::endl;
-        return trace_py_threads(pid, addrs, enable_py_threads);
+        resolve_interp_head(pid, maps, false, caller, found);
+        addrs = found;
+        return true;
     }
 
-}
\ No newline at end of file
+    std::vector<py_thread> dump_py_threads(pid_t pid, bool enable_py_threads, bool non_stop)
+    {
+        ProfilerSession session(pid, non_stop);
+        return session.Sample(enable_py_threads);
+    }
+}
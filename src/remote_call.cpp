@@ -0,0 +1,346 @@
+#include <sys/mman.h>
+#include <sys/ptrace.h>
+#include <sys/syscall.h>
+#include <sys/user.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <sstream>
+
+#include <custom_exceptions.h>
+#include <memory_map.h>
+#include <ptrace_wrapper.h>
+#include <remote_call.h>
+
+namespace spiritsaway::cpy_frame
+{
+	// below rsp the interrupted function may keep data in its red zone
+	static const unsigned long long stack_skip = 256;
+	static const std::size_t max_call_args = 6;
+	// movabs imm64 into rdi, rsi, rdx, rcx, r8 and r9
+	static const std::uint8_t arg_movs[max_call_args][2] = {
+		{ 0x48, 0xbf }, { 0x48, 0xbe }, { 0x48, 0xba }, { 0x48, 0xb9 }, { 0x49, 0xb8 }, { 0x49, 0xb9 },
+	};
+	// six argument moves, fn to r11, xor eax, call r11 and the store of rax
+	static const std::size_t max_call_code = max_call_args * 10 + 10 + 2 + 3 + 10;
+
+	static void append_imm(std::vector<std::uint8_t>& code, std::uint64_t value)
+	{
+		for (std::size_t i = 0; i < sizeof(value); i++)
+		{
+			code.push_back(static_cast<std::uint8_t>(value >> (8 * i)));
+		}
+	}
+
+	// Wait for the SIGTRAP of a single step or of the trampoline's int3. The
+	// handler of a signal arriving meanwhile would run on the hijacked registers,
+	// so signals are suppressed and appended to signals instead, to be queued
+	// again by requeue_signals once the registers are restored. A group-stop is
+	// resumed since the call has to finish first.
+	static void wait_for_trap(pid_t pid, enum __ptrace_request resume_request, std::vector<int>& signals)
+	{
+		int status;
+		for (;;)
+		{
+			if (waitpid(pid, &status, __WALL) == -1)
+			{
+				if (errno == EINTR)
+				{
+					continue;
+				}
+				std::ostringstream ss;
+				ss << "Failed to waitpid() PID " << pid << ": " << strerror(errno);
+				throw PtraceException(ss.str());
+			}
+			if (WIFEXITED(status) || WIFSIGNALED(status))
+			{
+				std::ostringstream ss;
+				ss << "Child process " << pid << " exited with status " << status;
+				throw TerminateException(ss.str());
+			}
+			if (!WIFSTOPPED(status))
+			{
+				continue;
+			}
+			const int event = status >> 16;
+			const int signum = WSTOPSIG(status);
+			if (event == 0 && signum == SIGTRAP)
+			{
+				return;
+			}
+			if (event == 0)
+			{
+				signals.push_back(signum);
+			}
+			if (ptrace(resume_request, pid, 0, 0) == -1)
+			{
+				std::ostringstream ss;
+				ss << "Failed to resume PID " << pid << " for a remote call: " << strerror(errno);
+				throw PtraceException(ss.str());
+			}
+		}
+	}
+
+	// Queue the signals wait_for_trap held back on the thread again. It stays
+	// stopped, they are reported and delivered once it is resumed.
+	static void requeue_signals(pid_t pid, const std::vector<int>& signals)
+	{
+		for (int signum : signals)
+		{
+			// the thread may be gone already, then so is the signal
+			syscall(SYS_tkill, pid, signum);
+		}
+	}
+
+	RemoteCaller::RemoteCaller(pid_t pid)
+		: pid_(pid),
+		page_(0),
+		page_size_(getpagesize()),
+		syscall_insn_(0)
+	{
+	}
+
+	RemoteCaller::~RemoteCaller()
+	{
+		try
+		{
+			Release();
+		}
+		catch (const std::runtime_error&)
+		{
+			// the target is running or gone, the page stays
+		}
+	}
+
+	std::uintptr_t RemoteCaller::FindSyscallInsn() const
+	{
+		// the vdso is small and always has one for its fallback paths
+		const MemoryMap maps(pid_);
+		std::vector<const mapping*> candidates;
+		for (const auto& one_mapping : maps.mappings())
+		{
+			if (one_mapping.readable && one_mapping.executable)
+			{
+				if (one_mapping.path == "[vdso]")
+				{
+					candidates.insert(candidates.begin(), &one_mapping);
+				}
+				else
+				{
+					candidates.push_back(&one_mapping);
+				}
+			}
+		}
+		std::vector<std::uint8_t> block(1 << 16);
+		for (const mapping* one_mapping : candidates)
+		{
+			for (std::uintptr_t addr = one_mapping->start; addr + 1 < one_mapping->end; )
+			{
+				const std::size_t n = std::min<std::size_t>(block.size(), one_mapping->end - addr);
+				try
+				{
+					ptrace_read(pid_, reinterpret_cast<void*>(addr), block.data(), n);
+				}
+				catch (const PtraceException&)
+				{
+					break;
+				}
+				for (std::size_t i = 0; i + 1 < n; i++)
+				{
+					if (block[i] == 0x0f && block[i + 1] == 0x05)
+					{
+						return addr + i;
+					}
+				}
+				// the blocks overlap by one byte so no pair is split
+				addr += n - 1;
+			}
+		}
+		std::ostringstream ss;
+		ss << "No syscall instruction found in PID " << pid_;
+		throw PtraceException(ss.str());
+	}
+
+	long RemoteCaller::Syscall(long number, std::initializer_list<long> args)
+	{
+		if (syscall_insn_ == 0)
+		{
+			syscall_insn_ = FindSyscallInsn();
+		}
+		const user_regs_struct oldregs = ptrace_get_regs(pid_);
+		user_regs_struct regs = oldregs;
+		unsigned long long* const arg_regs[] = { &regs.rdi, &regs.rsi, &regs.rdx, &regs.r10, &regs.r8, &regs.r9 };
+		std::size_t i = 0;
+		for (long arg : args)
+		{
+			*arg_regs[i++] = arg;
+		}
+		regs.rax = number;
+		// a syscall the target was stopped in must not be restarted at our rip
+		regs.orig_rax = -1;
+		regs.rip = syscall_insn_;
+		ptrace_set_regs(pid_, regs);
+		long result = 0;
+		std::vector<int> signals;
+		try
+		{
+			if (ptrace(PTRACE_SINGLESTEP, pid_, 0, 0) == -1)
+			{
+				std::ostringstream ss;
+				ss << "Failed to PTRACE_SINGLESTEP PID " << pid_ << ": " << strerror(errno);
+				throw PtraceException(ss.str());
+			}
+			wait_for_trap(pid_, PTRACE_SINGLESTEP, signals);
+			result = ptrace_get_regs(pid_).rax;
+		}
+		catch (const PtraceException&)
+		{
+			ptrace_set_regs(pid_, oldregs);
+			requeue_signals(pid_, signals);
+			throw;
+		}
+		ptrace_set_regs(pid_, oldregs);
+		requeue_signals(pid_, signals);
+		return result;
+	}
+
+	void RemoteCaller::Write(std::uintptr_t addr, const std::vector<std::uint8_t>& bytes)
+	{
+		for (std::size_t i = 0; i < bytes.size(); i += sizeof(long))
+		{
+			// pad the last word with int3
+			long word;
+			std::memset(&word, 0xcc, sizeof(word));
+			std::memcpy(&word, bytes.data() + i, std::min(sizeof(word), bytes.size() - i));
+			ptrace_poke(pid_, reinterpret_cast<void*>(addr + i), reinterpret_cast<void*>(word));
+		}
+	}
+
+	std::size_t RemoteCaller::RunBatch(remote_call* calls, std::size_t n_calls)
+	{
+		// the code grows from the start of the page, the result slots from its end
+		std::vector<std::uint8_t> code;
+		std::size_t n = 0;
+		for (; n < n_calls; n++)
+		{
+			if (code.size() + max_call_code + 1 + (n + 1) * sizeof(long) > page_size_)
+			{
+				break;
+			}
+			const remote_call& call = calls[n];
+			if (call.args.size() > max_call_args)
+			{
+				throw FatalException("A remote call takes at most six arguments");
+			}
+			for (std::size_t i = 0; i < call.args.size(); i++)
+			{
+				code.insert(code.end(), arg_movs[i], arg_movs[i] + 2);
+				append_imm(code, call.args[i]);
+			}
+			// movabs r11, fn; xor eax, eax (no vector registers for varargs);
+			// call r11; movabs [slot], rax
+			code.insert(code.end(), { 0x49, 0xbb });
+			append_imm(code, reinterpret_cast<std::uintptr_t>(call.fn));
+			code.insert(code.end(), { 0x31, 0xc0, 0x41, 0xff, 0xd3, 0x48, 0xa3 });
+			append_imm(code, page_ + page_size_ - (n + 1) * sizeof(long));
+		}
+		// int3
+		code.push_back(0xcc);
+		Write(page_, code);
+
+		const user_regs_struct oldregs = ptrace_get_regs(pid_);
+		user_regs_struct regs = oldregs;
+		regs.rip = page_;
+		// 16 byte aligned at every call as the ABI wants it
+		regs.rsp = (oldregs.rsp - stack_skip) & ~15ULL;
+		regs.orig_rax = -1;
+		ptrace_set_regs(pid_, regs);
+		std::vector<long> results(n);
+		std::vector<int> signals;
+		try
+		{
+			ptrace_condition(pid_);
+			wait_for_trap(pid_, PTRACE_CONT, signals);
+			ptrace_read(pid_, reinterpret_cast<void*>(page_ + page_size_ - n * sizeof(long)), results.data(),
+				n * sizeof(long));
+		}
+		catch (const PtraceException&)
+		{
+			ptrace_set_regs(pid_, oldregs);
+			requeue_signals(pid_, signals);
+			throw;
+		}
+		ptrace_set_regs(pid_, oldregs);
+		requeue_signals(pid_, signals);
+		for (std::size_t i = 0; i < n; i++)
+		{
+			calls[i].result = results[n - 1 - i];
+		}
+		return n;
+	}
+
+	void RemoteCaller::CallBatch(remote_call* calls, std::size_t n_calls)
+	{
+		if (page_ == 0 && n_calls)
+		{
+			const long addr = Syscall(SYS_mmap, { 0, static_cast<long>(page_size_),
+				PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 });
+			if (addr < 0 && addr > -4096)
+			{
+				std::ostringstream ss;
+				ss << "Failed to map a page in PID " << pid_ << ": " << strerror(-addr);
+				throw PtraceException(ss.str());
+			}
+			page_ = addr;
+			// the target's threads run on during a call, a child they fork must not
+			// inherit a writable and executable page
+			const long result = Syscall(SYS_madvise, { addr, static_cast<long>(page_size_), MADV_DONTFORK });
+			if (result != 0)
+			{
+				Release();
+				std::ostringstream ss;
+				ss << "Failed to madvise the page in PID " << pid_ << ": " << strerror(-result);
+				throw PtraceException(ss.str());
+			}
+		}
+		std::size_t done = 0;
+		while (done < n_calls)
+		{
+			done += RunBatch(calls + done, n_calls - done);
+		}
+	}
+
+	long RemoteCaller::Call(void* fn, std::initializer_list<long> args)
+	{
+		remote_call call{ fn, args, 0 };
+		CallBatch(&call, 1);
+		return call.result;
+	}
+
+	void RemoteCaller::Release()
+	{
+		if (page_ == 0)
+		{
+			return;
+		}
+		const long result = Syscall(SYS_munmap, { static_cast<long>(page_), static_cast<long>(page_size_) });
+		if (result != 0)
+		{
+			std::ostringstream ss;
+			ss << "Failed to unmap the page in PID " << pid_ << ": " << strerror(-result);
+			throw PtraceException(ss.str());
+		}
+		page_ = 0;
+	}
+
+	void RemoteCaller::Abandon()
+	{
+		page_ = 0;
+		// the instruction went with the old image
+		syscall_insn_ = 0;
+	}
+}
@@ -0,0 +1,229 @@
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <sstream>
+
+#include <custom_exceptions.h>
+#include <posix_file_util.h>
+#include <remote_memory.h>
+
+namespace spiritsaway::cpy_frame
+{
+	const char* remote_memory_kind_name(RemoteMemoryKind kind)
+	{
+		switch (kind)
+		{
+		case RemoteMemoryKind::VmReadv:
+			return "process_vm_readv";
+		case RemoteMemoryKind::ProcMem:
+			return "/proc/pid/mem";
+		case RemoteMemoryKind::Ptrace:
+			return "ptrace";
+		}
+		return "unknown";
+	}
+
+	read_result<void> RemoteMemory::TryRead(void* addr, void* dest, std::size_t n_bytes)
+	{
+		remote_chunk chunk{ addr, dest, n_bytes };
+		return TryReadV(&chunk, 1);
+	}
+
+	read_result<void*> RemoteMemory::TryReadPtr(void* addr)
+	{
+		void* result = nullptr;
+		return TryRead(addr, &result, sizeof(result)).map([&result]() { return result; });
+	}
+
+	void RemoteMemory::Read(void* addr, void* dest, std::size_t n_bytes)
+	{
+		remote_chunk chunk{ addr, dest, n_bytes };
+		ReadV(&chunk, 1);
+	}
+
+	void RemoteMemory::ReadV(const remote_chunk* chunks, std::size_t n_chunks)
+	{
+		const auto result = TryReadV(chunks, n_chunks);
+		if (!result)
+		{
+			throw_read_error(pid_, result.error());
+		}
+	}
+
+	void* RemoteMemory::ReadPtr(void* addr)
+	{
+		void* result = nullptr;
+		Read(addr, &result, sizeof(result));
+		return result;
+	}
+
+	long RemoteMemory::ReadLong(void* addr)
+	{
+		long result = 0;
+		Read(addr, &result, sizeof(result));
+		return result;
+	}
+
+	std::string RemoteMemory::ReadString(void* addr)
+	{
+		// read in blocks that never cross a page boundary, so that a string near the
+		// end of a mapping does not fault on the unmapped page after it
+		static const std::size_t block_size = 256;
+		const std::size_t page_size = getpagesize();
+		std::string result;
+		char block[block_size];
+		while (true)
+		{
+			const std::size_t to_page_end = page_size - reinterpret_cast<std::size_t>(addr) % page_size;
+			const std::size_t n = std::min(block_size, to_page_end);
+			Read(addr, block, n);
+			const void* end = memchr(block, '\0', n);
+			if (end != nullptr)
+			{
+				result.append(block, reinterpret_cast<const char*>(end) - block);
+				break;
+			}
+			result.append(block, n);
+			addr += n;
+		}
+		return result;
+	}
+
+	std::unique_ptr<uint8_t[]> RemoteMemory::ReadBytes(void* addr, std::size_t n_bytes)
+	{
+		std::unique_ptr<uint8_t[]> bytes(new uint8_t[n_bytes]());
+		Read(addr, bytes.get(), n_bytes);
+		return bytes;
+	}
+
+	std::unique_ptr<RemoteMemory> RemoteMemory::Create(pid_t pid, RemoteMemoryKind kind)
+	{
+		switch (kind)
+		{
+		case RemoteMemoryKind::VmReadv:
+			return std::make_unique<VmReadvMemory>(pid);
+		case RemoteMemoryKind::ProcMem:
+			return std::make_unique<ProcMemMemory>(pid);
+		case RemoteMemoryKind::Ptrace:
+			return std::make_unique<PtraceMemory>(pid);
+		}
+		throw FatalException("Unknown remote memory kind");
+	}
+
+	std::unique_ptr<RemoteMemory> RemoteMemory::Probe(pid_t pid, void* probe_addr)
+	{
+		const RemoteMemoryKind kinds[] = {
+			RemoteMemoryKind::VmReadv,
+			RemoteMemoryKind::ProcMem,
+			RemoteMemoryKind::Ptrace,
+		};
+		for (auto kind : kinds)
+		{
+			try
+			{
+				auto mem = Create(pid, kind);
+				mem->ReadPtr(probe_addr);
+				// a refused process_vm_readv reads through ptrace, prefer /proc/pid/mem
+				if (mem->Kind() == kind)
+				{
+					return mem;
+				}
+			}
+			catch (const std::runtime_error&)
+			{
+				// not usable under the current kernel or container policy, try the next one
+			}
+		}
+		std::ostringstream ss;
+		ss << "No remote memory backend can read PID " << pid << " at " << probe_addr;
+		throw PtraceException(ss.str());
+	}
+
+	read_result<void> PtraceMemory::TryReadV(const remote_chunk* chunks, std::size_t n_chunks)
+	{
+		for (std::size_t i = 0; i < n_chunks; i++)
+		{
+			const auto result = try_ptrace_peek_read(pid_, chunks[i].addr, chunks[i].dest, chunks[i].len);
+			if (!result)
+			{
+				return result;
+			}
+		}
+		return {};
+	}
+
+	ProcMemMemory::ProcMemMemory(pid_t pid)
+		: RemoteMemory(pid),
+		fd_(-1)
+	{
+		std::ostringstream ss;
+		ss << "/proc/" << pid << "/mem";
+		fd_ = OpenRdonly(ss.str().c_str());
+	}
+
+	ProcMemMemory::~ProcMemMemory()
+	{
+		cpy_frame::Close(fd_);
+	}
+
+	read_result<void> ProcMemMemory::TryReadV(const remote_chunk* chunks, std::size_t n_chunks)
+	{
+		static const std::size_t max_iov = 1024;
+		iovec local[max_iov];
+		std::size_t i = 0;
+		while (i < n_chunks)
+		{
+			// merge the run of chunks that are contiguous in the target
+			const uint8_t* start = reinterpret_cast<const uint8_t*>(chunks[i].addr);
+			std::size_t expected = 0;
+			std::size_t n_iov = 0;
+			while (i + n_iov < n_chunks && n_iov < max_iov &&
+				reinterpret_cast<const uint8_t*>(chunks[i + n_iov].addr) == start + expected)
+			{
+				local[n_iov].iov_base = chunks[i + n_iov].dest;
+				local[n_iov].iov_len = chunks[i + n_iov].len;
+				expected += chunks[i + n_iov].len;
+				n_iov++;
+			}
+			const ssize_t n = preadv(fd_, local, n_iov, reinterpret_cast<off_t>(start));
+			if (n != static_cast<ssize_t>(expected))
+			{
+				return read_failure(n < 0 ? errno : EFAULT, const_cast<uint8_t*>(start) + (n < 0 ? 0 : n));
+			}
+			i += n_iov;
+		}
+		return {};
+	}
+
+	read_result<void> VmReadvMemory::TryReadV(const remote_chunk* chunks, std::size_t n_chunks)
+	{
+		if (!refused_)
+		{
+			const auto result = try_ptrace_vm_readv(pid_, chunks, n_chunks);
+			if (!result)
+			{
+				return tl::make_unexpected(result.error());
+			}
+			if (*result)
+			{
+				return {};
+			}
+			// not permitted for this pid (seccomp, a changed credential), the
+			// other targets keep their process_vm_readv
+			refused_ = true;
+		}
+		for (std::size_t i = 0; i < n_chunks; i++)
+		{
+			const auto result = try_ptrace_peek_read(pid_, chunks[i].addr, chunks[i].dest, chunks[i].len);
+			if (!result)
+			{
+				return result;
+			}
+		}
+		return {};
+	}
+}
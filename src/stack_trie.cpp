@@ -0,0 +1,106 @@
+#include <algorithm>
+
+#include <stack_trie.h>
+
+namespace spiritsaway::cpy_frame
+{
+	StackTrie::StackTrie()
+	{
+		nodes_.push_back({ { 0, 0, 0 }, root, 0, 0, 0 });
+	}
+
+	std::uint32_t StackTrie::Insert(const interned_pyframe* frames, std::size_t n_frames, std::uint64_t count)
+	{
+		std::uint32_t current = root;
+		nodes_[root].total_count += count;
+		// the trie grows from the outermost frame
+		for (std::size_t i = n_frames; i-- > 0;)
+		{
+			const child_key key{ current, frames[i] };
+			auto iter = children_.find(key);
+			if (iter == children_.end())
+			{
+				const auto child = static_cast<std::uint32_t>(nodes_.size());
+				nodes_.push_back({ frames[i], current, nodes_[current].depth + 1, 0, 0 });
+				iter = children_.emplace(key, child).first;
+			}
+			current = iter->second;
+			nodes_[current].total_count += count;
+		}
+		nodes_[current].self_count += count;
+		return current;
+	}
+
+	interned_pyframes_t StackTrie::Stack(std::uint32_t node_id) const
+	{
+		interned_pyframes_t frames;
+		frames.reserve(nodes_[node_id].depth);
+		for (; node_id != root; node_id = nodes_[node_id].parent)
+		{
+			frames.push_back(nodes_[node_id].frame);
+		}
+		return frames;
+	}
+
+	void StackTrie::Merge(const StackTrie& other, const StringTable& other_strings, StringTable& strings)
+	{
+		// a parent always has a smaller id than its children, so one pass maps
+		// every node of other after its parent
+		std::vector<std::uint32_t> mapped(other.nodes_.size(), root);
+		std::unordered_map<std::uint32_t, std::uint32_t> string_ids;
+		auto map_string = [&](std::uint32_t id)
+		{
+			auto iter = string_ids.find(id);
+			if (iter == string_ids.end())
+			{
+				iter = string_ids.emplace(id, strings.Intern(other_strings.Str(id))).first;
+			}
+			return iter->second;
+		};
+		nodes_[root].total_count += other.nodes_[root].total_count;
+		for (std::uint32_t i = 1; i < other.nodes_.size(); i++)
+		{
+			const node& other_node = other.nodes_[i];
+			const std::uint32_t parent = mapped[other_node.parent];
+			const interned_pyframe frame{ map_string(other_node.frame.file), map_string(other_node.frame.name),
+				other_node.frame.line };
+			const child_key key{ parent, frame };
+			auto iter = children_.find(key);
+			if (iter == children_.end())
+			{
+				const auto child = static_cast<std::uint32_t>(nodes_.size());
+				nodes_.push_back({ frame, parent, nodes_[parent].depth + 1, 0, 0 });
+				iter = children_.emplace(key, child).first;
+			}
+			mapped[i] = iter->second;
+			nodes_[iter->second].self_count += other_node.self_count;
+			nodes_[iter->second].total_count += other_node.total_count;
+		}
+	}
+
+	void StackTrie::WriteFolded(std::ostream& os, const StringTable& strings, std::string_view prefix) const
+	{
+		for (std::uint32_t i = 1; i < nodes_.size(); i++)
+		{
+			if (nodes_[i].self_count == 0)
+			{
+				continue;
+			}
+			interned_pyframes_t frames = Stack(i);
+			std::reverse(frames.begin(), frames.end());
+			if (!prefix.empty())
+			{
+				os << prefix << ';';
+			}
+			for (std::size_t j = 0; j < frames.size(); j++)
+			{
+				if (j)
+				{
+					os << ';';
+				}
+				os << strings.Str(frames[j].file) << ':' << strings.Str(frames[j].name) << ':' << frames[j].line;
+			}
+			os << ' ' << nodes_[i].self_count << '\n';
+		}
+	}
+}
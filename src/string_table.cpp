@@ -0,0 +1,104 @@
+#include <cerrno>
+#include <sstream>
+
+#include <python2.7/Python.h>
+
+#include <custom_exceptions.h>
+#include <string_table.h>
+
+namespace spiritsaway::cpy_frame
+{
+	// file and function names longer than this are garbage
+	static const Py_ssize_t max_remote_size = 1 << 16;
+	// remote addresses remembered before the oldest ones are forgotten
+	static const std::size_t max_remote_ids = 1 << 16;
+
+	StringTable::StringTable(void* string_type_addr)
+		: string_type_addr_(string_type_addr)
+	{
+	}
+
+	void StringTable::Retarget(void* string_type_addr)
+	{
+		remote_ids_.clear();
+		string_type_addr_ = string_type_addr;
+	}
+
+	std::uint32_t StringTable::Intern(std::string_view str)
+	{
+		auto iter = ids_.find(str);
+		if (iter != ids_.end())
+		{
+			return iter->second;
+		}
+		const auto id = static_cast<std::uint32_t>(strings_.size());
+		strings_.emplace_back(str);
+		ids_.emplace(strings_.back(), id);
+		return id;
+	}
+
+	std::uint32_t StringTable::Get(RemoteMemory& mem, void* str_obj)
+	{
+		const auto id = TryGet(mem, str_obj);
+		if (!id)
+		{
+			if (id.error().err == EINVAL)
+			{
+				std::ostringstream ss;
+				ss << "Object at " << str_obj << " is not a valid string object";
+				throw PtraceException(ss.str());
+			}
+			throw_read_error(mem.pid(), id.error());
+		}
+		return *id;
+	}
+
+	read_result<std::uint32_t> StringTable::TryGet(RemoteMemory& mem, void* str_obj)
+	{
+		// ob_type, ob_size and ob_shash sit next to each other in the object header
+		void* type = nullptr;
+		Py_ssize_t size = 0;
+		long hash = 0;
+		remote_chunk header[] = {
+			{ str_obj + offsetof(PyStringObject, ob_type), &type, sizeof(type) },
+			{ str_obj + offsetof(PyStringObject, ob_size), &size, sizeof(size) },
+			{ str_obj + offsetof(PyStringObject, ob_shash), &hash, sizeof(hash) },
+		};
+		const auto header_read = mem.TryReadV(header, sizeof(header) / sizeof(header[0]));
+		if (!header_read)
+		{
+			return tl::make_unexpected(header_read.error());
+		}
+		if ((string_type_addr_ && type != string_type_addr_) || size < 0 || size > max_remote_size)
+		{
+			return read_failure(EINVAL, str_obj);
+		}
+
+		auto iter = remote_ids_.find(str_obj);
+		if (iter != remote_ids_.end() && iter->second.size == size && iter->second.hash == hash)
+		{
+			return iter->second.id;
+		}
+		remote_reads_++;
+		std::string str(size, '\0');
+		const auto body_read = mem.TryRead(str_obj + offsetof(PyStringObject, ob_sval), &str[0], size);
+		if (!body_read)
+		{
+			return tl::make_unexpected(body_read.error());
+		}
+		const std::uint32_t id = Intern(str);
+		if (hash == -1)
+		{
+			// never hashed, a string reusing the address with the same length
+			// could not be told apart, read it every time
+			return id;
+		}
+		if (remote_ids_.size() >= max_remote_ids && iter == remote_ids_.end())
+		{
+			// the interned strings stay, only their addresses are read again
+			remote_ids_.clear();
+		}
+		remote_ids_[str_obj] = { size, hash, id };
+		return id;
+	}
+}
@@ -0,0 +1,222 @@
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+#include <sstream>
+#include <unordered_map>
+#include <utility>
+
+#include <symbol_cache.h>
+
+namespace spiritsaway::cpy_frame
+{
+	static const char* const cache_header = "cpp_py_frame symbols 2";
+
+	// mkdir -p with private directories, returns false if dir does not exist
+	// afterwards
+	static bool make_dirs(const std::string& dir)
+	{
+		for (std::size_t pos = dir.find('/', 1); ; pos = dir.find('/', pos + 1))
+		{
+			const std::string prefix = dir.substr(0, pos);
+			if (mkdir(prefix.c_str(), 0700) == -1 && errno != EEXIST)
+			{
+				return false;
+			}
+			if (pos == std::string::npos)
+			{
+				return true;
+			}
+		}
+	}
+
+	SymbolCache::SymbolCache(const std::string& dir)
+		: dir_(dir)
+	{
+	}
+
+	std::string SymbolCache::Path(const std::string& key) const
+	{
+		return dir_ + "/" + key + ".addrs";
+	}
+
+	// Contents of path if it is a regular file of ours that nobody else may write.
+	static bool read_private_file(const std::string& path, std::string& content)
+	{
+		const int fd = open(path.c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+		if (fd == -1)
+		{
+			return false;
+		}
+		struct stat st;
+		bool ok = fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_uid == geteuid() &&
+			(st.st_mode & (S_IWGRP | S_IWOTH)) == 0;
+		char buffer[4096];
+		for (ssize_t n = 0; ok && (n = read(fd, buffer, sizeof(buffer))) != 0; )
+		{
+			if (n < 0)
+			{
+				ok = errno == EINTR;
+				continue;
+			}
+			content.append(buffer, n);
+		}
+		close(fd);
+		return ok;
+	}
+
+	bool SymbolCache::Load(const std::string& key, PyAddresses& addrs, PyABI& abi) const
+	{
+		std::string content;
+		if (!read_private_file(Path(key), content))
+		{
+			return false;
+		}
+		std::istringstream fp(content);
+		std::string line;
+		if (!std::getline(fp, line) || line != cache_header)
+		{
+			return false;
+		}
+		PyAddresses result;
+		int abi_value = -1;
+		int pie = -1;
+		while (std::getline(fp, line))
+		{
+			std::istringstream ss(line);
+			std::string name;
+			unsigned long value = 0;
+			// decimal, or hex with a 0x prefix
+			ss.unsetf(std::ios::basefield);
+			if (!(ss >> name >> value))
+			{
+				return false;
+			}
+			void* addr = reinterpret_cast<void*>(value);
+			if (name == "abi")
+			{
+				abi_value = static_cast<int>(value);
+			}
+			else if (name == "pie")
+			{
+				pie = static_cast<int>(value);
+			}
+			else if (name == "tstate_addr")
+			{
+				result.tstate_addr = addr;
+			}
+			else if (name == "interp_head_addr")
+			{
+				result.interp_head_addr = addr;
+			}
+			else if (name == "interp_head_fn_addr")
+			{
+				result.interp_head_fn_addr = addr;
+			}
+			else if (name == "frame_type_addr")
+			{
+				result.frame_type_addr = addr;
+			}
+			else if (name == "code_type_addr")
+			{
+				result.code_type_addr = addr;
+			}
+			else if (name == "string_type_addr")
+			{
+				result.string_type_addr = addr;
+			}
+		}
+		if (abi_value < 0 || pie < 0)
+		{
+			return false;
+		}
+		result.pie = pie != 0;
+		addrs = result;
+		abi = static_cast<PyABI>(abi_value);
+		return true;
+	}
+
+	void SymbolCache::Store(const std::string& key, const PyAddresses& addrs, PyABI abi) const
+	{
+		if (!make_dirs(dir_))
+		{
+			return;
+		}
+		const std::string path = Path(key);
+		std::ostringstream fp;
+		fp << cache_header << '\n';
+		fp << "abi " << static_cast<int>(abi) << '\n';
+		fp << "pie " << (addrs.pie ? 1 : 0) << '\n' << std::hex << std::showbase;
+		fp << "tstate_addr " << reinterpret_cast<unsigned long>(addrs.tstate_addr) << '\n';
+		fp << "interp_head_addr " << reinterpret_cast<unsigned long>(addrs.interp_head_addr) << '\n';
+		fp << "interp_head_fn_addr " << reinterpret_cast<unsigned long>(addrs.interp_head_fn_addr) << '\n';
+		fp << "frame_type_addr " << reinterpret_cast<unsigned long>(addrs.frame_type_addr) << '\n';
+		fp << "code_type_addr " << reinterpret_cast<unsigned long>(addrs.code_type_addr) << '\n';
+		fp << "string_type_addr " << reinterpret_cast<unsigned long>(addrs.string_type_addr) << '\n';
+		const std::string content = fp.str();
+
+		// a unique name per writer, the pool's threads store concurrently; mkstemp
+		// creates it 0600 so others may not write the entry
+		std::string tmp_path = path + ".tmp.XXXXXX";
+		const int fd = mkstemp(&tmp_path[0]);
+		if (fd == -1)
+		{
+			return;
+		}
+		const bool written = write(fd, content.data(), content.size()) == static_cast<ssize_t>(content.size());
+		// readers never see a partially written entry
+		if (close(fd) != 0 || !written || std::rename(tmp_path.c_str(), path.c_str()) != 0)
+		{
+			std::remove(tmp_path.c_str());
+		}
+	}
+
+	const SymbolCache* SymbolCache::Default()
+	{
+		static const std::string dir = []() -> std::string
+		{
+			if (const char* env = std::getenv("CPY_FRAME_SYMBOL_CACHE"))
+			{
+				return env;
+			}
+			if (const char* xdg = std::getenv("XDG_CACHE_HOME"); xdg && *xdg)
+			{
+				return std::string(xdg) + "/cpp_py_frame";
+			}
+			if (const char* home = std::getenv("HOME"); home && *home)
+			{
+				return std::string(home) + "/.cache/cpp_py_frame";
+			}
+			return std::string();
+		}();
+		static const SymbolCache cache(dir);
+		return dir.empty() ? nullptr : &cache;
+	}
+
+	static std::mutex shared_mutex;
+	static std::unordered_map<std::string, std::pair<PyAddresses, PyABI>> shared_entries;
+
+	bool SymbolCache::LoadShared(const std::string& key, PyAddresses& addrs, PyABI& abi)
+	{
+		std::lock_guard<std::mutex> guard(shared_mutex);
+		auto iter = shared_entries.find(key);
+		if (iter == shared_entries.end())
+		{
+			return false;
+		}
+		addrs = iter->second.first;
+		abi = iter->second.second;
+		return true;
+	}
+
+	void SymbolCache::StoreShared(const std::string& key, const PyAddresses& addrs, PyABI abi)
+	{
+		std::lock_guard<std::mutex> guard(shared_mutex);
+		shared_entries[key] = std::make_pair(addrs, abi);
+	}
+}
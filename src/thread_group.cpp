@@ -0,0 +1,515 @@
+#include <dirent.h>
+#include <sys/ptrace.h>
+#include <sys/wait.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <sstream>
+#include <thread>
+
+#include <custom_exceptions.h>
+#include <thread_group.h>
+
+namespace spiritsaway::cpy_frame
+{
+	using freeze_clock = std::chrono::steady_clock;
+
+	// vfork children are left alone, they exec or exit right away and their
+	// parent is blocked meanwhile
+	static const long follow_options = PTRACE_O_TRACECLONE | PTRACE_O_TRACEFORK | PTRACE_O_TRACEEXEC;
+
+	// how often StopSeized checks its threads while another tracee's stop is
+	// waiting to be collected
+	static const std::chrono::microseconds pending_poll_interval(50);
+
+	// stop signals of job control, a PTRACE_EVENT_STOP with one of these is a
+	// group-stop rather than our PTRACE_INTERRUPT
+	static bool is_group_stop(int signum)
+	{
+		return signum == SIGSTOP || signum == SIGTSTP || signum == SIGTTIN || signum == SIGTTOU;
+	}
+
+	std::vector<pid_t> list_threads(pid_t pid)
+	{
+		std::ostringstream dirname;
+		dirname << "/proc/" << pid << "/task";
+		std::unique_ptr<DIR, int (*)(DIR*)> dir(opendir(dirname.str().c_str()), &closedir);
+		if (!dir)
+		{
+			std::ostringstream ss;
+			ss << "Failed to list the threads of PID " << pid << ": " << strerror(errno);
+			if (errno == ENOENT)
+			{
+				throw TerminateException(ss.str());
+			}
+			throw PtraceException(ss.str());
+		}
+		std::vector<pid_t> result;
+		while (const dirent* entry = readdir(dir.get()))
+		{
+			if (entry->d_name[0] >= '0' && entry->d_name[0] <= '9')
+			{
+				result.push_back(static_cast<pid_t>(std::atoi(entry->d_name)));
+			}
+		}
+		std::sort(result.begin(), result.end());
+		return result;
+	}
+
+	ThreadGroup::ThreadGroup(pid_t pid, bool leader_seized, bool leader_stopped, bool follow)
+		: pid_(pid),
+		follow_(follow)
+	{
+		if (leader_seized)
+		{
+			if (follow_)
+			{
+				if (!leader_stopped)
+				{
+					throw FatalException("Following a process needs its seized leader stopped");
+				}
+				if (ptrace(PTRACE_SETOPTIONS, pid_, 0, follow_options) == -1)
+				{
+					std::ostringstream err;
+					err << "Failed to PTRACE_SETOPTIONS PID " << pid_ << ": " << strerror(errno);
+					throw PtraceException(err.str());
+				}
+			}
+			threads_.push_back({ pid_, leader_stopped, false });
+		}
+		try
+		{
+			SeizeNew();
+		}
+		catch (...)
+		{
+			// release what we seized, the leader stays with the caller
+			if (leader_seized)
+			{
+				threads_.erase(std::remove_if(threads_.begin(), threads_.end(),
+					[this](const thread_state& thread) { return thread.tid == pid_; }), threads_.end());
+			}
+			try
+			{
+				Detach();
+			}
+			catch (const std::runtime_error&)
+			{
+			}
+			throw;
+		}
+	}
+
+	ThreadGroup::~ThreadGroup()
+	{
+		try
+		{
+			Detach();
+		}
+		catch (const std::runtime_error&)
+		{
+			// the process is gone
+		}
+	}
+
+	void ThreadGroup::SeizeNew()
+	{
+		// no shortcut on the thread count: threads_ may still hold threads that
+		// exited since, and one started meanwhile would go unseized
+		std::vector<thread_state> seized;
+		for (pid_t tid : list_threads(pid_))
+		{
+			auto iter = std::lower_bound(threads_.begin(), threads_.end(), tid,
+				[](const thread_state& thread, pid_t value) { return thread.tid < value; });
+			if (iter != threads_.end() && iter->tid == tid)
+			{
+				continue;
+			}
+			if (ptrace(PTRACE_SEIZE, tid, 0, follow_ ? follow_options : 0) == 0)
+			{
+				seized.push_back({ tid, false, false });
+			}
+			else if (errno != ESRCH)
+			{
+				// the thread exited meanwhile if ESRCH
+				std::ostringstream ss;
+				ss << "Failed to PTRACE_SEIZE thread " << tid << " of PID " << pid_ << ": " << strerror(errno);
+				throw PtraceException(ss.str());
+			}
+		}
+		if (!seized.empty())
+		{
+			threads_.insert(threads_.end(), seized.begin(), seized.end());
+			std::sort(threads_.begin(), threads_.end(),
+				[](const thread_state& a, const thread_state& b) { return a.tid < b.tid; });
+		}
+	}
+
+	// Collect the initial stop of a tracee the kernel attached on clone or fork.
+	// Returns false if it died first.
+	static bool wait_new_tracee(pid_t tid)
+	{
+		for (;;)
+		{
+			int status;
+			if (waitpid(tid, &status, __WALL) == -1)
+			{
+				if (errno == EINTR)
+				{
+					continue;
+				}
+				return false;
+			}
+			if (WIFEXITED(status) || WIFSIGNALED(status))
+			{
+				return false;
+			}
+			if (WIFSTOPPED(status))
+			{
+				return true;
+			}
+		}
+	}
+
+	void ThreadGroup::OnEvent(pid_t tid, int event)
+	{
+		unsigned long msg = 0;
+		if (event != PTRACE_EVENT_EXEC && ptrace(PTRACE_GETEVENTMSG, tid, 0, &msg) == -1)
+		{
+			std::ostringstream ss;
+			ss << "Failed to PTRACE_GETEVENTMSG thread " << tid << ": " << strerror(errno);
+			throw PtraceException(ss.str());
+		}
+		const pid_t child = static_cast<pid_t>(msg);
+		switch (event)
+		{
+		case PTRACE_EVENT_CLONE:
+			// the Stop in progress leaves it stopped like the others
+			if (wait_new_tracee(child))
+			{
+				born_.push_back({ child, true, false });
+			}
+			break;
+		case PTRACE_EVENT_FORK:
+			if (wait_new_tracee(child))
+			{
+				forked_.push_back(child);
+			}
+			break;
+		case PTRACE_EVENT_EXEC:
+			// the other threads are gone, the exec'ing one took over the pid
+			exec_ = true;
+			break;
+		default:
+			break;
+		}
+	}
+
+	// Collect the stop of an interrupted thread without waiting. A signal or a
+	// followed event that arrived before the interrupt is handled and the
+	// interrupt reported by a later call. Returns false while the thread is still
+	// running; a thread that exited gets tid 0. group_stop, if given, tells whether the stop is a
+	// group-stop of job control.
+	bool ThreadGroup::ReapStop(pid_t& tid, bool* group_stop)
+	{
+		for (;;)
+		{
+			int status;
+			const pid_t ret = waitpid(tid, &status, __WALL | WNOHANG);
+			if (ret == 0)
+			{
+				return false;
+			}
+			if (ret == -1)
+			{
+				if (errno == EINTR)
+				{
+					continue;
+				}
+				if (errno == ECHILD)
+				{
+					tid = 0;
+					return true;
+				}
+				std::ostringstream ss;
+				ss << "Failed to waitpid() thread " << tid << ": " << strerror(errno);
+				throw PtraceException(ss.str());
+			}
+			if (WIFEXITED(status) || WIFSIGNALED(status))
+			{
+				tid = 0;
+				return true;
+			}
+			if (!WIFSTOPPED(status))
+			{
+				continue;
+			}
+			const int event = status >> 16;
+			if (event == PTRACE_EVENT_STOP)
+			{
+				if (group_stop)
+				{
+					*group_stop = is_group_stop(WSTOPSIG(status));
+				}
+				return true;
+			}
+			if (event != 0)
+			{
+				OnEvent(tid, event);
+			}
+			const int signum = WSTOPSIG(status);
+			if (ptrace(PTRACE_CONT, tid, 0, signum == SIGTRAP ? 0 : signum) == -1)
+			{
+				if (errno == ESRCH)
+				{
+					continue;
+				}
+				std::ostringstream ss;
+				ss << "Failed to PTRACE_CONT thread " << tid << ": " << strerror(errno);
+				throw PtraceException(ss.str());
+			}
+			return false;
+		}
+	}
+
+	const freeze_stats& ThreadGroup::Stop()
+	{
+		// a following group is told about new threads, and seizing one the
+		// kernel attached already but not reported yet would fail
+		if (!follow_)
+		{
+			SeizeNew();
+		}
+		return StopSeized();
+	}
+
+	// Block until a tracee of this thread has a stop or exit to report, without
+	// collecting it: the tracer may trace other targets, whose stops are theirs.
+	// Returns whether it is one of the pending threads.
+	bool ThreadGroup::WaitPending(const std::vector<std::size_t>& pending) const
+	{
+		siginfo_t info;
+		for (;;)
+		{
+			info.si_pid = 0;
+			if (waitid(P_ALL, 0, &info, WEXITED | WSTOPPED | WNOWAIT | __WALL) == 0)
+			{
+				break;
+			}
+			if (errno != EINTR)
+			{
+				// e.g. ECHILD, the next pass reaps the exit
+				return true;
+			}
+		}
+		for (std::size_t index : pending)
+		{
+			if (threads_[index].tid == info.si_pid)
+			{
+				return true;
+			}
+		}
+		return false;
+	}
+
+	const freeze_stats& ThreadGroup::StopSeized()
+	{
+		const auto start = freeze_clock::now();
+		// indices of the threads interrupted but not seen stopped yet
+		std::vector<std::size_t> pending;
+		for (std::size_t i = 0; i < threads_.size(); i++)
+		{
+			thread_state& thread = threads_[i];
+			if (thread.stopped)
+			{
+				continue;
+			}
+			if (ptrace(PTRACE_INTERRUPT, thread.tid, 0, 0) == 0)
+			{
+				pending.push_back(i);
+			}
+			else if (errno == ESRCH)
+			{
+				// exited, collect its status
+				ReapStop(thread.tid);
+				thread.tid = 0;
+			}
+			else
+			{
+				std::ostringstream ss;
+				ss << "Failed to PTRACE_INTERRUPT thread " << thread.tid << ": " << strerror(errno);
+				throw PtraceException(ss.str());
+			}
+		}
+		freeze_clock::time_point first_stop;
+		freeze_clock::time_point last_stop = start;
+		bool any_stop = false;
+		auto stopped = [&](std::size_t index, bool group_stop)
+		{
+			threads_[index].stopped = threads_[index].tid != 0;
+			threads_[index].group_stopped = group_stop;
+			last_stop = freeze_clock::now();
+			if (!any_stop)
+			{
+				first_stop = last_stop;
+				any_stop = true;
+			}
+		};
+		// poll every pending thread so the stops are timed as they arrive; when a
+		// whole pass found nothing, sleep until any tracee has news and let the
+		// next pass collect it
+		while (!pending.empty())
+		{
+			bool progress = false;
+			for (std::size_t k = 0; k < pending.size(); )
+			{
+				bool group_stop = false;
+				if (ReapStop(threads_[pending[k]].tid, &group_stop))
+				{
+					stopped(pending[k], group_stop);
+					pending[k] = pending.back();
+					pending.pop_back();
+					progress = true;
+				}
+				else
+				{
+					k++;
+				}
+			}
+			if (!progress && !pending.empty() && !WaitPending(pending))
+			{
+				// a stop of another target traced by this thread is ready, it is
+				// not ours to collect
+				std::this_thread::sleep_for(pending_poll_interval);
+			}
+		}
+		threads_.erase(std::remove_if(threads_.begin(), threads_.end(),
+			[](const thread_state& thread) { return thread.tid == 0; }), threads_.end());
+		if (!born_.empty())
+		{
+			threads_.insert(threads_.end(), born_.begin(), born_.end());
+			born_.clear();
+			std::sort(threads_.begin(), threads_.end(),
+				[](const thread_state& a, const thread_state& b) { return a.tid < b.tid; });
+		}
+		if (threads_.empty())
+		{
+			std::ostringstream ss;
+			ss << "Every thread of PID " << pid_ << " exited";
+			throw TerminateException(ss.str());
+		}
+		stats_.threads = threads_.size();
+		stats_.freeze_time = last_stop - start;
+		stats_.skew = any_stop ? last_stop - first_stop : std::chrono::nanoseconds(0);
+		return stats_;
+	}
+
+	void ThreadGroup::Resume()
+	{
+		for (auto& thread : threads_)
+		{
+			if (!thread.stopped)
+			{
+				continue;
+			}
+			// a thread the user stopped stays stopped until SIGCONT, the next Stop
+			// interrupts it and sees whether it was continued. A thread killed
+			// while stopped is reaped by the next Stop.
+			const auto request = thread.group_stopped ? PTRACE_LISTEN : PTRACE_CONT;
+			if (ptrace(request, thread.tid, 0, 0) == -1 && errno != ESRCH)
+			{
+				std::ostringstream ss;
+				ss << "Failed to " << (thread.group_stopped ? "PTRACE_LISTEN" : "PTRACE_CONT") << " thread "
+					<< thread.tid << ": " << strerror(errno);
+				throw PtraceException(ss.str());
+			}
+			thread.stopped = false;
+		}
+	}
+
+	void ThreadGroup::Poll()
+	{
+		for (auto& thread : threads_)
+		{
+			if (thread.stopped || thread.tid == 0)
+			{
+				continue;
+			}
+			// ReapStop resumes the thread after a signal or a followed event, only
+			// the stops of job control come back
+			bool group_stop = false;
+			if (!ReapStop(thread.tid, &group_stop) || thread.tid == 0)
+			{
+				continue;
+			}
+			// stopped by the user, or continued again while it listened
+			const auto request = group_stop ? PTRACE_LISTEN : PTRACE_CONT;
+			if (ptrace(request, thread.tid, 0, 0) == -1 && errno != ESRCH)
+			{
+				std::ostringstream ss;
+				ss << "Failed to " << (group_stop ? "PTRACE_LISTEN" : "PTRACE_CONT") << " thread " << thread.tid
+					<< ": " << strerror(errno);
+				throw PtraceException(ss.str());
+			}
+			thread.group_stopped = group_stop;
+		}
+		threads_.erase(std::remove_if(threads_.begin(), threads_.end(),
+			[](const thread_state& thread) { return thread.tid == 0; }), threads_.end());
+		// threads cloned meanwhile run right away rather than at the next Resume
+		for (auto& thread : born_)
+		{
+			if (ptrace(PTRACE_CONT, thread.tid, 0, 0) == -1 && errno != ESRCH)
+			{
+				std::ostringstream ss;
+				ss << "Failed to PTRACE_CONT thread " << thread.tid << ": " << strerror(errno);
+				throw PtraceException(ss.str());
+			}
+			thread.stopped = false;
+		}
+		if (!born_.empty())
+		{
+			threads_.insert(threads_.end(), born_.begin(), born_.end());
+			born_.clear();
+			std::sort(threads_.begin(), threads_.end(),
+				[](const thread_state& a, const thread_state& b) { return a.tid < b.tid; });
+		}
+	}
+
+	std::vector<pid_t> ThreadGroup::TakeForked()
+	{
+		std::vector<pid_t> result;
+		result.swap(forked_);
+		return result;
+	}
+
+	bool ThreadGroup::TakeExec()
+	{
+		const bool result = exec_;
+		exec_ = false;
+		return result;
+	}
+
+	void ThreadGroup::Detach()
+	{
+		for (pid_t child : forked_)
+		{
+			ptrace(PTRACE_DETACH, child, 0, 0);
+		}
+		forked_.clear();
+		if (threads_.empty())
+		{
+			return;
+		}
+		// PTRACE_DETACH needs a stopped tracee
+		StopSeized();
+		for (const auto& thread : threads_)
+		{
+			ptrace(PTRACE_DETACH, thread.tid, 0, 0);
+		}
+		threads_.clear();
+	}
+}
@@ -0,0 +1,133 @@
+#include <elf_utils.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <string>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <vector>
+using namespace spiritsaway;
+
+// the symbols ELF::GetAddresses looks up
+static const char* wanted[] = {
+	"_PyThreadState_Current", "interp_head", "PyInterpreterState_Head", "PyFrame_Type", "PyCode_Type",
+	"PyString_Type", "_PyEval_RequestCodeExtraIndex", "_PyCode_GetExtra", "_PyCode_SetExtra", "PyBytes_Type",
+};
+static const std::size_t n_wanted = sizeof(wanted) / sizeof(wanted[0]);
+
+// The strcmp walk over .dynsym and .symtab that the hash lookups replaced.
+static void linear_lookup(const char* p, std::vector<addr_t>& found)
+{
+	const auto* hdr = reinterpret_cast<const ehdr_t*>(p);
+	const auto section = [&](int idx)
+	{
+		return reinterpret_cast<const shdr_t*>(p + hdr->e_shoff + idx * hdr->e_shentsize);
+	};
+	found.assign(n_wanted, 0);
+	for (int i = 0; i < hdr->e_shnum; i++)
+	{
+		const shdr_t* s = section(i);
+		if ((s->sh_type != SHT_DYNSYM && s->sh_type != SHT_SYMTAB) || s->sh_entsize == 0)
+		{
+			continue;
+		}
+		const shdr_t* str = section(s->sh_link);
+		for (std::size_t j = 0; j < s->sh_size / s->sh_entsize; j++)
+		{
+			const auto* sym = reinterpret_cast<const sym_t*>(p + s->sh_offset + j * s->sh_entsize);
+			if (sym->st_shndx == SHN_UNDEF)
+			{
+				continue;
+			}
+			const char* name = p + str->sh_offset + sym->st_name;
+			for (std::size_t k = 0; k < n_wanted; k++)
+			{
+				if (!found[k] && std::strcmp(name, wanted[k]) == 0)
+				{
+					found[k] = sym->st_value;
+				}
+			}
+		}
+	}
+}
+
+static void hashed_lookup(cpy_frame::ELF& elf, std::vector<addr_t>& found)
+{
+	found.assign(n_wanted, 0);
+	for (std::size_t k = 0; k < n_wanted; k++)
+	{
+		const sym_t* sym = elf.FindSymbol(wanted[k]);
+		found[k] = sym ? sym->st_value : 0;
+	}
+}
+
+int main(int argc, char** argv)
+{
+	if (argc < 2)
+	{
+		std::cerr << "usage: " << argv[0] << " elf_file [rounds]" << std::endl;
+		return 1;
+	}
+	const int rounds = argc > 2 ? std::max(1, std::atoi(argv[2])) : 1000;
+	using bench_clock = std::chrono::steady_clock;
+
+	const int fd = open(argv[1], O_RDONLY);
+	if (fd < 0)
+	{
+		std::cerr << "Failed to open " << argv[1] << std::endl;
+		return 1;
+	}
+	const auto length = lseek(fd, 0, SEEK_END);
+	void* addr = mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (addr == MAP_FAILED)
+	{
+		std::cerr << "Failed to map " << argv[1] << std::endl;
+		return 1;
+	}
+
+	std::vector<addr_t> linear;
+	auto start = bench_clock::now();
+	for (int i = 0; i < rounds; i++)
+	{
+		linear_lookup(static_cast<const char*>(addr), linear);
+	}
+	const auto linear_time = (bench_clock::now() - start) / rounds;
+
+	// the first round builds the .symtab index and looks for a debug file
+	cpy_frame::ELF elf;
+	start = bench_clock::now();
+	elf.Open(argv[1], nullptr);
+	elf.Parse();
+	std::vector<addr_t> hashed;
+	hashed_lookup(elf, hashed);
+	const auto cold_time = bench_clock::now() - start;
+	start = bench_clock::now();
+	for (int i = 0; i < rounds; i++)
+	{
+		hashed_lookup(elf, hashed);
+	}
+	const auto hashed_time = (bench_clock::now() - start) / rounds;
+	munmap(addr, length);
+
+	int mismatches = 0;
+	for (std::size_t k = 0; k < n_wanted; k++)
+	{
+		// the hashed lookup may also find a symbol in a separate debug file
+		if (linear[k] && linear[k] != hashed[k])
+		{
+			std::cerr << wanted[k] << ": linear " << std::hex << linear[k] << " hashed " << hashed[k] << std::dec
+				<< std::endl;
+			mismatches++;
+		}
+	}
+	const auto us = [](bench_clock::duration d) { return std::chrono::duration<double, std::micro>(d).count(); };
+	std::cout << argv[1] << ": " << n_wanted << " symbols per round, " << rounds << " rounds" << std::endl;
+	std::cout << "linear walk " << us(linear_time) << "us/round" << std::endl;
+	std::cout << "hash lookup " << us(hashed_time) << "us/round, first round with open and index " << us(cold_time)
+		<< "us" << std::endl;
+	return mismatches ? 1 : 0;
+}
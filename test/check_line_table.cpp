@@ -0,0 +1,69 @@
+#include <code_cache.h>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <vector>
+using namespace spiritsaway;
+
+// The linear walk over co_lnotab that code_info::Line replaced, see
+// PyCode_Addr2Line.
+static std::size_t linear_line(const std::vector<uint8_t>& lnotab, int firstlineno, int f_lasti)
+{
+	int addr = 0;
+	int line = firstlineno;
+	const uint8_t* p = lnotab.data();
+	const uint8_t* end = p + lnotab.size() / 2 * 2;
+	while (p != end)
+	{
+		addr += *p++;
+		if (addr > f_lasti)
+		{
+			break;
+		}
+		line += *p++;
+	}
+	return static_cast<std::size_t>(line);
+}
+
+int main(int argc, char** argv)
+{
+	const int tables = argc > 1 ? std::atoi(argv[1]) : 10000;
+	const unsigned seed = argc > 2 ? static_cast<unsigned>(std::strtoul(argv[2], nullptr, 10)) : std::random_device()();
+	std::mt19937 rng(seed);
+	std::size_t lookups = 0;
+	for (int i = 0; i < tables; i++)
+	{
+		// odd sizes, zero address increments (collapsed rows) and 255 line
+		// increments (long jumps) all show up in real tables
+		std::vector<uint8_t> lnotab(rng() % 512);
+		for (auto& one_byte : lnotab)
+		{
+			const auto kind = rng() % 8;
+			one_byte = kind == 0 ? 0 : kind == 1 ? 255 : static_cast<uint8_t>(rng() % 16);
+		}
+		cpy_frame::code_info info;
+		info.firstlineno = static_cast<int>(rng() % 100000);
+		info.SetLineTable(lnotab.data(), lnotab.size());
+
+		int last_addr = 0;
+		for (std::size_t j = 0; j + 1 < lnotab.size(); j += 2)
+		{
+			last_addr += lnotab[j];
+		}
+		for (int f_lasti = 0; f_lasti <= last_addr + 2; f_lasti++)
+		{
+			const auto expected = linear_line(lnotab, info.firstlineno, f_lasti);
+			const auto actual = info.Line(f_lasti);
+			lookups++;
+			if (expected != actual)
+			{
+				std::cerr << "seed " << seed << " table " << i << " f_lasti " << f_lasti << ": expected line "
+					<< expected << " got " << actual << std::endl;
+				return 1;
+			}
+		}
+	}
+	std::cout << "seed " << seed << ": " << tables << " tables, " << lookups << " lookups match" << std::endl;
+	return 0;
+}
@@ -0,0 +1,211 @@
+#include <cpp_frame.h>
+#include <cxxabi.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+using namespace spiritsaway;
+
+struct function_symbol
+{
+	addr_t addr;
+	addr_t size;
+	const char* name;
+};
+
+struct sampled_frame
+{
+	cpy_frame::native_frame frame;
+	std::string module;
+	std::string name;
+};
+
+// The function symbols of .symtab and .dynsym as FindSymbolByAddress indexes
+// them, in file order.
+static bool read_functions(const char* p, std::vector<function_symbol>& functions)
+{
+	const auto* hdr = reinterpret_cast<const ehdr_t*>(p);
+	const auto section = [&](int idx)
+	{
+		return reinterpret_cast<const shdr_t*>(p + hdr->e_shoff + idx * hdr->e_shentsize);
+	};
+	bool has_symtab = false;
+	for (int i = 0; i < hdr->e_shnum; i++)
+	{
+		const shdr_t* s = section(i);
+		if ((s->sh_type != SHT_DYNSYM && s->sh_type != SHT_SYMTAB) || s->sh_entsize == 0)
+		{
+			continue;
+		}
+		has_symtab = has_symtab || s->sh_type == SHT_SYMTAB;
+		const shdr_t* str = section(s->sh_link);
+		for (std::size_t j = 1; j < s->sh_size / s->sh_entsize; j++)
+		{
+			const auto* sym = reinterpret_cast<const sym_t*>(p + s->sh_offset + j * s->sh_entsize);
+			const int type = ELF64_ST_TYPE(sym->st_info);
+			if ((type == STT_FUNC || type == STT_GNU_IFUNC) && sym->st_shndx != SHN_UNDEF && sym->st_value)
+			{
+				functions.push_back({ sym->st_value, sym->st_size, p + str->sh_offset + sym->st_name });
+			}
+		}
+	}
+	return has_symtab;
+}
+
+// Runtime address of vaddr in the mapping, 0 if the mapping does not hold it.
+static std::uintptr_t runtime_address(const char* p, const cpy_frame::mapping& one_mapping, addr_t vaddr)
+{
+	const auto* hdr = reinterpret_cast<const ehdr_t*>(p);
+	for (int i = 0; i < hdr->e_phnum; i++)
+	{
+		const auto* ph = reinterpret_cast<const phdr_t*>(p + hdr->e_phoff + i * hdr->e_phentsize);
+		if (ph->p_type != PT_LOAD || vaddr < ph->p_vaddr || vaddr >= ph->p_vaddr + ph->p_filesz)
+		{
+			continue;
+		}
+		const std::size_t file_offset = vaddr - ph->p_vaddr + ph->p_offset;
+		if (file_offset < one_mapping.offset || file_offset >= one_mapping.offset + (one_mapping.end - one_mapping.start))
+		{
+			return 0;
+		}
+		return one_mapping.start + (file_offset - one_mapping.offset);
+	}
+	return 0;
+}
+
+static std::string demangle(const char* name)
+{
+	int status = 0;
+	char* demangled = abi::__cxa_demangle(name, nullptr, nullptr, &status);
+	std::string result = status == 0 && demangled ? demangled : name;
+	std::free(demangled);
+	return result;
+}
+
+// The frames handed out before a Refresh must still read the same.
+static int check_kept(const std::vector<sampled_frame>& kept, const char* when)
+{
+	int errors = 0;
+	for (const auto& one : kept)
+	{
+		if (one.frame.module != one.module || one.frame.name != one.name)
+		{
+			std::cerr << when << ": frame " << one.frame.ip << " changed from " << one.module << " " << one.name
+				<< std::endl;
+			errors++;
+		}
+	}
+	return errors;
+}
+
+int main(int argc, char** argv)
+{
+	const pid_t pid = argc > 1 ? static_cast<pid_t>(std::atoi(argv[1])) : getpid();
+	const std::size_t per_module = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 500;
+
+	cpy_frame::NativeSymbolizer symbolizer(pid);
+	cpy_frame::MemoryMap maps(pid);
+	std::vector<sampled_frame> kept;
+	std::size_t lookups = 0;
+	int errors = 0;
+	for (const auto& one_mapping : maps.mappings())
+	{
+		if (!one_mapping.executable || one_mapping.path.empty() || one_mapping.path[0] != '/')
+		{
+			continue;
+		}
+		const std::string file = "/proc/" + std::to_string(pid) + "/root" + one_mapping.path;
+		const int fd = open(file.c_str(), O_RDONLY);
+		if (fd < 0)
+		{
+			continue;
+		}
+		const auto length = lseek(fd, 0, SEEK_END);
+		void* addr = mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+		close(fd);
+		if (addr == MAP_FAILED)
+		{
+			continue;
+		}
+		const char* p = static_cast<const char*>(addr);
+		std::vector<function_symbol> functions;
+		if (std::memcmp(p, ELFMAG, SELFMAG) != 0 || !read_functions(p, functions))
+		{
+			// without .symtab the index comes from a debug file this scan does not see
+			std::cout << one_mapping.path << ": no .symtab, skipped" << std::endl;
+			munmap(addr, length);
+			continue;
+		}
+		const std::size_t step = std::max<std::size_t>(1, functions.size() / std::max<std::size_t>(1, per_module));
+		std::size_t checked = 0;
+		for (std::size_t i = 0; i < functions.size(); i += step)
+		{
+			const function_symbol& target = functions[i];
+			const addr_t vaddr = target.addr + target.size / 2;
+			const std::uintptr_t ip = runtime_address(p, one_mapping, vaddr);
+			if (ip == 0)
+			{
+				continue;
+			}
+			// linear: the closest symbol at or below vaddr, any alias of it will do
+			addr_t closest = 0;
+			for (const auto& one : functions)
+			{
+				if (one.addr <= vaddr && one.addr > closest)
+				{
+					closest = one.addr;
+				}
+			}
+			const auto frame = symbolizer.Symbolize(reinterpret_cast<void*>(ip));
+			bool alias = false;
+			for (const auto& one : functions)
+			{
+				alias = alias || (one.addr == closest && frame.name == demangle(one.name));
+			}
+			lookups++;
+			checked++;
+			if (!alias || frame.offset != vaddr - closest || frame.module != one_mapping.path)
+			{
+				std::cerr << one_mapping.path << " " << std::hex << vaddr << ": expected " << demangle(target.name)
+					<< " at " << closest << " got " << frame << std::dec << std::endl;
+				errors++;
+			}
+			kept.push_back({ frame, std::string(frame.module), std::string(frame.name) });
+		}
+		std::cout << one_mapping.path << ": " << checked << " of " << functions.size() << " functions" << std::endl;
+		munmap(addr, length);
+	}
+
+	// a new module makes Refresh rebuild the list, unmapping it drops a loaded one
+	if (pid == getpid())
+	{
+		const int fd = open("/proc/self/exe", O_RDONLY);
+		void* extra = fd < 0 ? MAP_FAILED : mmap(nullptr, 4096, PROT_READ | PROT_EXEC, MAP_PRIVATE, fd, 0);
+		if (fd >= 0)
+		{
+			close(fd);
+		}
+		if (extra != MAP_FAILED)
+		{
+			symbolizer.Refresh();
+			const auto frame = symbolizer.Symbolize(extra);
+			errors += check_kept(kept, "after mapping a module");
+			munmap(extra, 4096);
+			symbolizer.Refresh();
+			errors += check_kept(kept, "after unmapping a module");
+			if (frame.module.empty())
+			{
+				std::cerr << "the module mapped at " << extra << " was not found" << std::endl;
+				errors++;
+			}
+		}
+	}
+	std::cout << lookups << " lookups, " << kept.size() << " frames kept across Refresh, " << errors << " errors"
+		<< std::endl;
+	return errors ? 1 : 0;
+}
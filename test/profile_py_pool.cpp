@@ -0,0 +1,93 @@
+#include <py_sampler.h>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <limits>
+using namespace spiritsaway;
+
+static std::atomic<bool> stop_sampling(false);
+
+static void on_interrupt(int)
+{
+	stop_sampling = true;
+}
+
+int main(int argc, char** argv)
+{
+	cpy_frame::pool_options options;
+	bool per_pid = false;
+	std::vector<pid_t> pids;
+	for (int i = 1; i < argc; i++)
+	{
+		if (std::strcmp(argv[i], "--nonstop") == 0)
+		{
+			options.non_stop = true;
+		}
+		else if (std::strcmp(argv[i], "--follow") == 0)
+		{
+			options.follow = true;
+		}
+		else if (std::strcmp(argv[i], "--per-pid") == 0)
+		{
+			per_pid = true;
+		}
+		else if (std::strcmp(argv[i], "--rate") == 0 && i + 1 < argc)
+		{
+			options.rate_hz = std::strtod(argv[++i], nullptr);
+		}
+		else if (std::strcmp(argv[i], "--duration") == 0 && i + 1 < argc)
+		{
+			options.duration = std::chrono::milliseconds(static_cast<long long>(std::strtod(argv[++i], nullptr) * 1000));
+		}
+		else if (std::strcmp(argv[i], "--workers") == 0 && i + 1 < argc)
+		{
+			options.workers = std::strtoul(argv[++i], nullptr, 10);
+		}
+		else if (std::strcmp(argv[i], "--overhead") == 0 && i + 1 < argc)
+		{
+			options.max_overhead = std::strtod(argv[++i], nullptr);
+		}
+		else
+		{
+			auto pid = std::strtol(argv[i], nullptr, 10);
+			if (pid <= 0 || pid > std::numeric_limits<pid_t>::max())
+			{
+				std::cerr << "Error: failed to parse \"" << argv[i] << "\" as a PID.\n\n";
+				return 1;
+			}
+			pids.push_back(static_cast<pid_t>(pid));
+		}
+	}
+	if (pids.empty())
+	{
+		std::cerr << "usage: " << argv[0] << " [--nonstop] [--follow] [--per-pid] [--rate hz] [--duration seconds]"
+			" [--workers n] [--overhead fraction] pid..." << std::endl;
+		return 1;
+	}
+	std::signal(SIGINT, on_interrupt);
+
+	try
+	{
+		cpy_frame::PoolSampler sampler(pids, options);
+		sampler.Run(&stop_sampling);
+		sampler.WriteFolded(std::cout, per_pid);
+		for (const auto& target : sampler.targets())
+		{
+			std::cerr << "pid " << target.pid;
+			if (!target.error.empty())
+			{
+				std::cerr << ": " << target.error;
+			}
+			std::cerr << std::endl << target.stats;
+		}
+		std::cerr << "total of " << sampler.targets().size() << " targets on " << sampler.workers() << " workers" << std::endl
+			<< sampler.stats();
+	}
+	catch (const std::exception& e)
+	{
+		std::cerr << e.what() << std::endl;
+		return 1;
+	}
+	return 0;
+}
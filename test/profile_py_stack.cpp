@@ -0,0 +1,61 @@
+#include <py_sampler.h>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <limits>
+using namespace spiritsaway;
+
+static std::atomic<bool> stop_sampling(false);
+
+static void on_interrupt(int)
+{
+	stop_sampling = true;
+}
+
+int main(int argc, char** argv)
+{
+	if (argc < 2)
+	{
+		std::cerr << "usage: " << argv[0] << " pid [rate_hz] [duration_seconds] [--nonstop]" << std::endl;
+		return 1;
+	}
+	auto pid = std::strtol(argv[1], nullptr, 10);
+	if (pid <= 0 || pid > std::numeric_limits<pid_t>::max())
+	{
+		std::cerr << "Error: failed to parse \"" << argv[1] << "\" as a PID.\n\n";
+		return 1;
+	}
+	cpy_frame::sampler_options options;
+	int positional = 0;
+	for (int i = 2; i < argc; i++)
+	{
+		if (std::strcmp(argv[i], "--nonstop") == 0)
+		{
+			options.non_stop = true;
+		}
+		else if (positional++ == 0)
+		{
+			options.rate_hz = std::strtod(argv[i], nullptr);
+		}
+		else
+		{
+			options.duration = std::chrono::milliseconds(static_cast<long long>(std::strtod(argv[i], nullptr) * 1000));
+		}
+	}
+	std::signal(SIGINT, on_interrupt);
+
+	try
+	{
+		cpy_frame::PySampler sampler(pid, options);
+		sampler.Run(&stop_sampling);
+		sampler.trie().WriteFolded(std::cout, sampler.strings());
+		std::cerr << sampler.stats();
+	}
+	catch (const std::exception& e)
+	{
+		std::cerr << e.what() << std::endl;
+		return 1;
+	}
+	return 0;
+}